@@ -1,10 +1,13 @@
 #include "config.h"
 #include "bone_geometry.h"
+#include "mesh_optimizer.h"
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
 #include <glm/gtx/io.hpp>
 #include <glm/gtx/transform.hpp>
+#include <glm/gtc/packing.hpp>
 
 /*
  * For debugging purpose.
@@ -25,7 +28,22 @@ std::ostream& operator<<(std::ostream& os, const BoundingBox& bounds)
 	return os;
 }
 
-// FIXME: Implement bone animation.
+void VertexFaceAdjacency::build(const std::vector<glm::uvec3>& mesh_faces,
+		size_t nvertices)
+{
+	offsets.assign(nvertices + 1, 0);
+	for (const auto& f : mesh_faces)
+		for (int k = 0; k < 3; k++)
+			offsets[f[k] + 1]++;
+	for (size_t v = 0; v < nvertices; v++)
+		offsets[v + 1] += offsets[v];
+
+	faces.resize(offsets[nvertices]);
+	std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+	for (size_t i = 0; i < mesh_faces.size(); i++)
+		for (int k = 0; k < 3; k++)
+			faces[cursor[mesh_faces[i][k]]++] = i;
+}
 
 Mesh::Mesh() {}
 
@@ -39,6 +57,26 @@ void Mesh::loadpmd(const std::string& fn)
 	computeBounds();
 	mr.getMaterial(materials);
 
+	// Reorder faces within each material for the vertex cache, then
+	// number vertices by first use so skinning streams through memory.
+	float acmr = average_cache_miss_ratio(faces, vertices.size());
+	std::vector<FaceRange> ranges;
+	for (const auto& material : materials)
+		ranges.emplace_back(material.offset, material.offset + material.nfaces);
+	optimize_vertex_cache(faces, ranges, vertices.size());
+	std::vector<uint32_t> remap;
+	reorder_vertices_by_first_use(faces, vertices.size(), remap);
+	remap_vertex_array(vertices, remap);
+	remap_vertex_array(vertex_normals, remap);
+	remap_vertex_array(uv_coordinates, remap);
+	uv_halves.clear();
+	for (const auto& uv : uv_coordinates)
+		uv_halves.push_back(glm::packHalf2x16(uv));
+	if (verbose && !faces.empty())
+		std::cout << "Vertex cache: " << acmr << " -> "
+			<< average_cache_miss_ratio(faces, vertices.size())
+			<< " vertices/face.\n";
+
 	std::vector<glm::vec3> offsets;
 	glm::vec3 offset;
 	std::vector<int> pids;
@@ -51,24 +89,382 @@ void Mesh::loadpmd(const std::string& fn)
 	}
 	std::vector<SparseTuple> weights;
 	mr.getJointWeights(weights);
+	for (auto& tup : weights)
+		if (tup.vid >= 0 && size_t(tup.vid) < remap.size())
+			tup.vid = remap[tup.vid];
 	skeleton = new Skeleton(offsets, pids, weights);
+
+	adjacency.build(faces, vertices.size());
+	influences.build(weights, vertices.size(), skeleton->get_joint_count());
+	std::vector<glm::mat4> frames;
+	skeleton->joint_frames(frames);
+	std::vector<glm::vec3> pivots;
+	for (const auto& frame : frames)
+		pivots.push_back(glm::vec3(frame[3]));
+	size_t ninfluences = influences.getNumberOfInfluences();
+	float prune_error = influences.prune(kMaxInfluences, kMinInfluenceWeight,
+			vertices, pivots, pids);
+	skinning_stream.build(influences, vertices, vertex_normals);
+	skinning.bind(skeleton);
+	computeJointBounds();
+	buildLOD(kLODMaxDepth, kLODMinImportance, kLODMaxBones, lod);
+	if (!verbose)
+		return;
+	if (!vertices.empty()) {
+		float tuple_bytes = float(weights.size() * sizeof(SparseTuple)) / vertices.size();
+		float table_bytes = float(influences.getByteSize()) / vertices.size();
+		std::cout << "Influence table: " << table_bytes << " bytes/vertex, "
+			<< tuple_bytes - table_bytes << " bytes/vertex less than the "
+			<< tuple_bytes << " bytes/vertex SparseTuple list.\n";
+		std::cout << "Influence budget: " << kMaxInfluences << " joints/vertex, "
+			<< ninfluences - influences.getNumberOfInfluences()
+			<< " influences dropped, max position error " << prune_error << ".\n";
+	}
+	std::cout << "Skinning kernel: " << SkinningEngine::getKernelName() << "\n";
 }
 
 void Mesh::updateAnimation()
 {
-	animated_vertices = vertices;
-	// FIXME: blend the vertices to animated_vertices, rather than copy
-	//		  the data directly.
+	skinning.updatePalette(skeleton);
+	skinning.skin(skinning_stream, animated_vertices, &animated_normals);
+	if (recompute_normals) {
+		std::vector<IndexRange> moved = { { 0, vertices.size() } };
+		computeNormals(moved);
+	} else {
+		face_normals.clear(); // Stale once the mesh moves without them.
+	}
+	updateBounds();
+}
+
+void Mesh::updateAnimation(const std::vector<int>& bones,
+		std::vector<IndexRange>& dirty)
+{
+	dirty.clear();
+	if (animated_vertices.size() != vertices.size() ||
+	    animated_normals.size() != vertices.size()) {
+		updateAnimation();
+		dirty.push_back({ 0, vertices.size() });
+		return;
+	}
+	std::vector<IndexRange> block_ranges;
+	if (!collectBlocks(bones, block_ranges))
+		return;
+
+	skinning.skin(skinning_stream, block_ranges, animated_vertices, &animated_normals);
+	if (!recompute_normals)
+		face_normals.clear();
+	blocksToVertices(block_ranges, dirty);
+	if (recompute_normals)
+		computeNormals(dirty);
+	updateBounds();
 }
 
+bool Mesh::skinInto(VertexSink& sink, bool full, const std::vector<int>& bones,
+		std::vector<IndexRange>& dirty)
+{
+	dirty.clear();
+	std::vector<IndexRange> block_ranges;
+	if (full) {
+		skinning.updatePalette(skeleton);
+		block_ranges.push_back({ 0, skinning_stream.getNumberOfBlocks() });
+	} else if (!collectBlocks(bones, block_ranges)) {
+		return true;
+	}
+	face_normals.clear();
+	blocksToVertices(block_ranges, dirty);
+	updateBounds();
+
+	for (size_t i = 0; i < dirty.size(); i++) {
+		glm::vec3* positions;
+		uint32_t* normals;
+		if (!sink.map(dirty[i], positions, normals))
+			return false;
+		skinning.skin(skinning_stream, { block_ranges[i] }, positions, normals);
+		if (!sink.unmap())
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Instances sharing a level of detail are skinned together.
+ */
+void Mesh::updateInstances(std::vector<MeshInstance>& instances) const
+{
+	std::map<const MeshLOD*, std::vector<MeshInstance*>> groups;
+	for (auto& instance : instances)
+		groups[instance.lod].push_back(&instance);
+
+	for (const auto& group : groups) {
+		std::vector<const std::vector<glm::mat4>*> palettes;
+		std::vector<SkinningTarget> targets;
+		for (MeshInstance* instance : group.second) {
+			instance->animated_vertices.resize(vertices.size());
+			instance->animated_normals.resize(vertices.size());
+			palettes.push_back(&instance->palette);
+			targets.push_back({ instance->animated_vertices.data(),
+					instance->animated_normals.data() });
+		}
+		const MeshLOD* lod = group.first;
+		skinning.skinInstances(lod ? lod->stream : skinning_stream, palettes, targets);
+	}
+}
+
+void Mesh::updateInstancePalettes(std::vector<MeshInstance>& instances) const
+{
+	std::map<const MeshLOD*, std::vector<SkeletonPose*>> groups;
+	for (auto& instance : instances)
+		groups[instance.lod].push_back(&instance.pose);
+	for (const auto& group : groups)
+		skeleton->evaluate_poses(group.second,
+				group.first ? &group.first->skeleton : nullptr);
+
+	int ninstances = instances.size();
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < ninstances; i++) {
+		const MeshLOD* level = instances[i].lod;
+		skinning.computePalette(skeleton, instances[i].pose.world,
+				instances[i].palette, level ? &level->skeleton : nullptr);
+	}
+}
+
+void Mesh::updateInstancePalettes(std::vector<MeshInstance>& instances,
+		const glm::mat4& view, const glm::mat4& projection) const
+{
+	selectLOD(instances, view, projection);
+	updateInstancePalettes(instances);
+}
+
+void Mesh::buildLOD(int max_depth, float min_importance, size_t max_bones,
+		MeshLOD& lod) const
+{
+	skeleton->build_lod(max_depth, min_importance, max_bones, lod.skeleton);
+	lod.influences = influences;
+	lod.influences.merge(lod.skeleton.joint_map,
+			influences.njoints + lod.skeleton.palette_bones.size());
+	lod.stream.build(lod.influences, vertices, vertex_normals);
+}
+
+float Mesh::projectedSize(const glm::mat4& view, const glm::mat4& projection) const
+{
+	glm::vec3 center = 0.5f * (bind_bounds.min + bind_bounds.max);
+	float radius = 0.5f * glm::length(bind_bounds.max - bind_bounds.min);
+	float depth = -glm::vec3(view * glm::vec4(center, 1.0f)).z;
+	if (depth <= radius)
+		return 1.0f;
+	return radius * projection[1][1] / depth;
+}
+
+void Mesh::selectLOD(std::vector<MeshInstance>& instances,
+		const glm::mat4& view, const glm::mat4& projection) const
+{
+	for (auto& instance : instances) {
+		float size = projectedSize(view * instance.model, projection);
+		instance.lod = (size < kLODScreenSize) ? &lod : nullptr;
+	}
+}
+
+/*
+ * Update the palette of the joints in the subtrees of the given bones (of
+ * all joints if there are none) that moved by more than pose_tolerance,
+ * and return the skinning blocks holding vertices weighted to them,
+ * merged into ranges. Returns false if there are none.
+ */
+bool Mesh::collectBlocks(const std::vector<int>& bones,
+		std::vector<IndexRange>& block_ranges)
+{
+	std::vector<int> joints;
+	for (int bone : bones)
+		skeleton->subtree_joints(bone, joints);
+	if (bones.empty())
+		for (size_t j = 0; j < influences.njoints; j++)
+			joints.push_back(j);
+	std::vector<int> changed;
+	skinning.updatePalette(skeleton, joints, joint_reach, pose_tolerance, changed);
+
+	std::vector<size_t> blocks;
+	for (int j : changed)
+		for (uint32_t i = influences.joint_offsets[j]; i < influences.joint_offsets[j + 1]; i++)
+			blocks.push_back(influences.joint_vertices[i] / kSkinLanes);
+	std::sort(blocks.begin(), blocks.end());
+	blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+	block_ranges.clear();
+	for (size_t b : blocks) {
+		if (!block_ranges.empty() && block_ranges.back().end == b)
+			block_ranges.back().end++;
+		else
+			block_ranges.push_back({ b, b + 1 });
+	}
+	return !block_ranges.empty();
+}
+
+void Mesh::blocksToVertices(const std::vector<IndexRange>& block_ranges,
+		std::vector<IndexRange>& ranges) const
+{
+	ranges.clear();
+	for (const auto& range : block_ranges)
+		ranges.push_back({ range.begin * kSkinLanes,
+				std::min(range.end * kSkinLanes, vertices.size()) });
+}
+
+/*
+ * Recompute face normals for the faces touching the moved vertices, then
+ * the area weighted normals of every vertex of those faces. On return the
+ * ranges cover all vertices whose normal was rewritten.
+ *
+ * Faces away from the moved vertices keep their normals from the previous
+ * call, so the first call after face_normals was cleared does everything.
+ */
+void Mesh::computeNormals(std::vector<IndexRange>& ranges)
+{
+	size_t nf = faces.size(), nv = vertices.size();
+	bool full = face_normals.size() != nf;
+	face_normals.resize(nf);
+	face_areas.resize(nf);
+	animated_normals.resize(nv);
+	face_stamps.resize(nf, 0);
+	vertex_stamps.resize(nv, 0);
+	stamp++;
+
+	std::vector<uint32_t> touched_faces, touched_vertices;
+	if (full) {
+		ranges.assign(1, { 0, nv });
+		touched_faces.resize(nf);
+		for (size_t f = 0; f < nf; f++)
+			touched_faces[f] = f;
+		touched_vertices.resize(nv);
+		for (size_t v = 0; v < nv; v++)
+			touched_vertices[v] = v;
+	} else {
+		for (const auto& range : ranges)
+			for (size_t v = range.begin; v < range.end; v++) {
+				if (vertex_stamps[v] != stamp) {
+					vertex_stamps[v] = stamp;
+					touched_vertices.push_back(v);
+				}
+				for (uint32_t i = adjacency.offsets[v]; i < adjacency.offsets[v + 1]; i++) {
+					uint32_t f = adjacency.faces[i];
+					if (face_stamps[f] == stamp)
+						continue;
+					face_stamps[f] = stamp;
+					touched_faces.push_back(f);
+					for (int k = 0; k < 3; k++) {
+						uint32_t u = faces[f][k];
+						if (vertex_stamps[u] != stamp) {
+							vertex_stamps[u] = stamp;
+							touched_vertices.push_back(u);
+						}
+					}
+				}
+			}
+		std::sort(touched_vertices.begin(), touched_vertices.end());
+		ranges.clear();
+		for (uint32_t v : touched_vertices) {
+			if (!ranges.empty() && ranges.back().end == v)
+				ranges.back().end++;
+			else
+				ranges.push_back({ v, v + 1 });
+		}
+	}
+
+	int ntf = touched_faces.size();
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < ntf; i++) {
+		uint32_t f = touched_faces[i];
+		const glm::vec3& a = animated_vertices[faces[f][0]];
+		const glm::vec3& b = animated_vertices[faces[f][1]];
+		const glm::vec3& c = animated_vertices[faces[f][2]];
+		glm::vec3 n = glm::cross(b - a, c - a);
+		float len = glm::length(n);
+		face_areas[f] = 0.5f * len;
+		face_normals[f] = glm::vec4(len > 0.0f ? n / len : n, 0.0f);
+	}
+
+	int ntv = touched_vertices.size();
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < ntv; i++) {
+		uint32_t v = touched_vertices[i];
+		glm::vec3 n(0.0f);
+		for (uint32_t j = adjacency.offsets[v]; j < adjacency.offsets[v + 1]; j++) {
+			uint32_t f = adjacency.faces[j];
+			n += face_areas[f] * glm::vec3(face_normals[f]);
+		}
+		float len = glm::length(n);
+		animated_normals[v] = pack_normal(len > 0.0f ? n / len : n);
+	}
+}
 
 void Mesh::computeBounds()
 {
+	bind_bounds.min = glm::vec3(std::numeric_limits<float>::max());
+	bind_bounds.max = glm::vec3(-std::numeric_limits<float>::max());
+	for (const auto& vert : vertices) {
+		bind_bounds.min = glm::min(glm::vec3(vert), bind_bounds.min);
+		bind_bounds.max = glm::max(glm::vec3(vert), bind_bounds.max);
+	}
+	bounds = bind_bounds;
+}
+
+void Mesh::computeJointBounds()
+{
+	BoundingBox empty;
+	empty.min = glm::vec3(std::numeric_limits<float>::max());
+	empty.max = glm::vec3(-std::numeric_limits<float>::max());
+	joint_bounds.assign(influences.njoints + 1, empty);
+	joint_reach.assign(influences.njoints, 0.0f);
+	for (size_t j = 0; j < influences.njoints; j++)
+		for (uint32_t i = influences.joint_offsets[j]; i < influences.joint_offsets[j + 1]; i++)
+			joint_reach[j] = std::max(joint_reach[j],
+					glm::length(glm::vec3(vertices[influences.joint_vertices[i]])));
+
+	auto grow = [this](size_t joint, const glm::vec3& p) {
+		BoundingBox& box = joint_bounds[joint];
+		box.min = glm::min(p, box.min);
+		box.max = glm::max(p, box.max);
+	};
+	for (size_t v = 0; v < vertices.size(); v++) {
+		bool weighted = false;
+		for (uint32_t i = influences.offsets[v]; i < influences.offsets[v + 1]; i++)
+			if (influences.weights[i] > 0.0f) {
+				grow(influences.joints[i], glm::vec3(vertices[v]));
+				weighted = true;
+			}
+		if (!weighted)
+			grow(influences.njoints, glm::vec3(vertices[v]));
+	}
+}
+
+/*
+ * Posed bounds as the union of the joint boxes moved by their palette
+ * matrices. Every vertex is in the box of each joint it is weighted to,
+ * and its weights add up to one, so the skinned vertex is a convex
+ * combination of points inside the moved boxes and thus inside their
+ * union.
+ */
+void Mesh::updateBounds()
+{
+	const auto& palette = skinning.getPalette();
+	if (joint_bounds.size() != palette.size() + 1)
+		return;
 	bounds.min = glm::vec3(std::numeric_limits<float>::max());
 	bounds.max = glm::vec3(-std::numeric_limits<float>::max());
-	for (const auto& vert : vertices) {
-		bounds.min = glm::min(glm::vec3(vert), bounds.min);
-		bounds.max = glm::max(glm::vec3(vert), bounds.max);
+	for (size_t j = 0; j < joint_bounds.size(); j++) {
+		const BoundingBox& box = joint_bounds[j];
+		if (box.min.x > box.max.x)
+			continue;
+		glm::vec3 center = 0.5f * (box.min + box.max);
+		glm::vec3 extent = 0.5f * (box.max - box.min);
+		if (j < palette.size()) {
+			const glm::mat4& m = palette[j];
+			glm::mat3 rot = glm::mat3(m);
+			center = glm::vec3(m * glm::vec4(center, 1.0f));
+			extent = glm::abs(rot[0]) * extent.x +
+				glm::abs(rot[1]) * extent.y +
+				glm::abs(rot[2]) * extent.z;
+		}
+		bounds.min = glm::min(center - extent, bounds.min);
+		bounds.max = glm::max(center + extent, bounds.max);
 	}
 }
 
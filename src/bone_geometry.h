@@ -8,6 +8,8 @@
 #include <glm/glm.hpp>
 #include <mmdadapter.h>
 #include "skeletal_sys.h"
+#include "skinning.h"
+#include "config.h"
 
 struct BoundingBox {
 	BoundingBox()
@@ -16,6 +18,17 @@ struct BoundingBox {
 	glm::vec3 min;
 	glm::vec3 max;
 };
+/*
+ * VertexFaceAdjacency: the faces around each vertex, in CSR form.
+ * Faces touching vertex v are faces[i] for i in [offsets[v], offsets[v + 1]).
+ */
+struct VertexFaceAdjacency {
+	std::vector<uint32_t> offsets;
+	std::vector<uint32_t> faces;
+
+	void build(const std::vector<glm::uvec3>& mesh_faces, size_t nvertices);
+};
+
 /*
 struct Joint {
 	// FIXME: Implement your Joint data structure.
@@ -27,29 +40,157 @@ struct Skeleton {
 	// FIXME: create skeleton and bone data structures
 };
 */
+/*
+ * MeshLOD: the mesh skinned with a reduced skeleton (see Mesh::buildLOD()).
+ * Influences of the frozen joints are merged into the joints they follow,
+ * so the stream has fewer influence slots per block.
+ */
+struct MeshLOD {
+	SkeletonLOD skeleton;
+	InfluenceTable influences;
+	SkinningStream stream;
+};
+
+/*
+ * MeshInstance: one posed copy of a shared Mesh, for crowds. It only owns
+ * its skeleton pose, joint palette (see SkinningEngine::computePalette())
+ * and skinned output; bind pose data, faces and materials stay in the Mesh.
+ * Distant instances point lod at a shared MeshLOD (see Mesh::selectLOD()).
+ */
+struct MeshInstance {
+	SkeletonPose pose;
+	glm::mat4 model = glm::mat4(1.0f); // Placement in the world.
+	const MeshLOD* lod = nullptr;
+	std::vector<glm::mat4> palette;
+	std::vector<glm::vec3> animated_vertices;
+	std::vector<uint32_t> animated_normals;
+};
+
 struct Mesh {
 	Mesh();
 	~Mesh();
 	std::vector<glm::vec4> vertices;
-	std::vector<glm::vec4> animated_vertices;
+	/*
+	 * Skinned vertices in the GPU layout: float3 positions and normals
+	 * packed as GL_INT_2_10_10_10_REV (see pack_normal()).
+	 */
+	std::vector<glm::vec3> animated_vertices;
+	std::vector<uint32_t> animated_normals;
 	std::vector<glm::uvec3> faces;
 	std::vector<glm::vec4> vertex_normals;
 	std::vector<glm::vec4> face_normals;
 	std::vector<glm::vec2> uv_coordinates;
+	std::vector<uint32_t> uv_halves; // uv_coordinates as packed half floats.
 	std::vector<Material> materials;
 	BoundingBox bounds;
+	/*
+	 * Bounds of the undeformed vertices. Unlike bounds they do not follow
+	 * the shared pose, so they size every instance the same way.
+	 */
+	BoundingBox bind_bounds;
 	Skeleton* skeleton;
+	InfluenceTable influences;
+	SkinningStream skinning_stream;
+	SkinningEngine skinning;
+	VertexFaceAdjacency adjacency;
+	/*
+	 * Derive animated_normals from the deformed faces (area weighted)
+	 * instead of rotating the bind pose normals.
+	 */
+	bool recompute_normals = false;
+	/*
+	 * Partial updates keep the previous output of vertices whose joints
+	 * moved them by at most this much since they were last skinned.
+	 */
+	float pose_tolerance = kPoseTolerance;
+	/*
+	 * Bind pose bounds of the vertices weighted to each joint, plus a
+	 * last box for unweighted vertices. updateBounds() derives the posed
+	 * bounds from these in O(joints).
+	 */
+	std::vector<BoundingBox> joint_bounds;
+	/*
+	 * Reduced skeleton for distant instances, built by loadpmd() from the
+	 * kLOD* defaults in config.h.
+	 */
+	MeshLOD lod;
+	/*
+	 * Have loadpmd() report its vertex cache, influence table and
+	 * skinning kernel statistics on stdout.
+	 */
+	bool verbose = false;
 
 	void loadpmd(const std::string& fn);
 	void updateAnimation();
+	/*
+	 * Re-skin only the vertices weighted to the subtrees of the given
+	 * bones, or to any joint if bones is empty, skipping joints that
+	 * moved by no more than pose_tolerance. Reports the vertex ranges of
+	 * animated_vertices and animated_normals that changed.
+	 */
+	void updateAnimation(const std::vector<int>& bones,
+			std::vector<IndexRange>& dirty);
+	/*
+	 * Zero-copy variant: skin straight into a sink, such as mapped vertex
+	 * buffers, instead of animated_vertices and animated_normals. With
+	 * full set every vertex is written, otherwise only the ranges that
+	 * updateAnimation(bones, dirty) would report, each mapped on its own,
+	 * and the sink must hold the previous pose elsewhere. Normals are
+	 * always the skinned ones, recompute_normals needs the CPU copies.
+	 * Returns false if the sink failed or lost its contents.
+	 */
+	bool skinInto(VertexSink& sink, bool full, const std::vector<int>& bones,
+			std::vector<IndexRange>& dirty);
+	/*
+	 * Skin every instance from its palette in one batched pass.
+	 */
+	void updateInstances(std::vector<MeshInstance>& instances) const;
+	/*
+	 * Evaluate the skeleton poses of all instances together and rebuild
+	 * their palettes from them.
+	 */
+	void updateInstancePalettes(std::vector<MeshInstance>& instances) const;
+	/*
+	 * Same, after choosing the level of detail of every instance for the
+	 * given camera with selectLOD().
+	 */
+	void updateInstancePalettes(std::vector<MeshInstance>& instances,
+			const glm::mat4& view, const glm::mat4& projection) const;
+	void buildLOD(int max_depth, float min_importance, size_t max_bones,
+			MeshLOD& lod) const;
+	/*
+	 * Height of the bind pose bounds on screen, as a fraction of the
+	 * viewport height, to choose between the full mesh and a MeshLOD.
+	 * Instances are posed independently of the shared mesh, so its posed
+	 * bounds say nothing about them; the bind pose keeps the choice stable
+	 * while an instance animates in place.
+	 */
+	float projectedSize(const glm::mat4& view, const glm::mat4& projection) const;
+	/*
+	 * Points the instances whose projectedSize() at their model matrix is
+	 * below kLODScreenSize at lod, and the others at the full mesh.
+	 */
+	void selectLOD(std::vector<MeshInstance>& instances,
+			const glm::mat4& view, const glm::mat4& projection) const;
 	int getNumberOfBones() const
 	{
 		return skeleton->get_size();
 	}
 	glm::vec3 getCenter() const { return 0.5f * glm::vec3(bounds.min + bounds.max); }
+	void updateBounds();
 private:
 	void computeBounds();
-	void computeNormals();
+	void computeJointBounds();
+	bool collectBlocks(const std::vector<int>& bones,
+			std::vector<IndexRange>& block_ranges);
+	void blocksToVertices(const std::vector<IndexRange>& block_ranges,
+			std::vector<IndexRange>& ranges) const;
+	void computeNormals(std::vector<IndexRange>& ranges);
+
+	std::vector<float> joint_reach; // Largest |v| weighted to each joint.
+	std::vector<float> face_areas;
+	std::vector<uint32_t> face_stamps, vertex_stamps;
+	uint32_t stamp = 0;
 };
 
 #endif
@@ -0,0 +1,107 @@
+#include "capsule_bvh.h"
+#include <cmath>
+
+namespace {
+
+const int kLeafCapsules = 2;
+
+}
+
+void CapsuleBVH::build(const std::vector<glm::vec3>& a, const std::vector<glm::vec3>& b,
+		float radius)
+{
+	nodes_.clear();
+	items_.resize(a.size());
+	if (a.empty())
+		return;
+
+	std::vector<glm::vec3> centers(a.size());
+	for (size_t i = 0; i < a.size(); i++) {
+		items_[i] = i;
+		centers[i] = 0.5f * (a[i] + b[i]);
+	}
+	nodes_.reserve(2 * a.size());
+	buildNode(centers, 0, a.size());
+	refit(a, b, radius);
+}
+
+/*
+ * Splits the capsules at the median center along the longest axis of the
+ * centers' bounds. Boxes are left to refit().
+ */
+int CapsuleBVH::buildNode(const std::vector<glm::vec3>& centers, int first, int count)
+{
+	int index = nodes_.size();
+	nodes_.push_back(Node());
+	if (count <= kLeafCapsules) {
+		nodes_[index].first = first;
+		nodes_[index].count = count;
+		nodes_[index].right = -1;
+		return index;
+	}
+
+	glm::vec3 lo = centers[items_[first]], hi = lo;
+	for (int i = first; i < first + count; i++) {
+		lo = glm::min(lo, centers[items_[i]]);
+		hi = glm::max(hi, centers[items_[i]]);
+	}
+	glm::vec3 extent = hi - lo;
+	int axis = 0;
+	if (extent.y > extent[axis]) axis = 1;
+	if (extent.z > extent[axis]) axis = 2;
+
+	int half = count / 2;
+	std::nth_element(items_.begin() + first, items_.begin() + first + half,
+			items_.begin() + first + count,
+			[&centers, axis](int l, int r) { return centers[l][axis] < centers[r][axis]; });
+
+	buildNode(centers, first, half);
+	int right = buildNode(centers, first + half, count - half);
+	nodes_[index].first = first;
+	nodes_[index].count = 0;
+	nodes_[index].right = right;
+	return index;
+}
+
+void CapsuleBVH::refit(const std::vector<glm::vec3>& a, const std::vector<glm::vec3>& b,
+		float radius)
+{
+	glm::vec3 r(radius * kBoxPadding);
+	for (int n = nodes_.size() - 1; n >= 0; n--) {
+		Node& node = nodes_[n];
+		if (node.count == 0) {
+			const Node& left = nodes_[n + 1];
+			const Node& right = nodes_[node.right];
+			node.lo = glm::min(left.lo, right.lo);
+			node.hi = glm::max(left.hi, right.hi);
+			continue;
+		}
+		node.lo = glm::vec3(std::numeric_limits<float>::infinity());
+		node.hi = -node.lo;
+		for (int i = node.first; i < node.first + node.count; i++) {
+			int c = items_[i];
+			node.lo = glm::min(node.lo, glm::min(a[c], b[c]) - r);
+			node.hi = glm::max(node.hi, glm::max(a[c], b[c]) + r);
+		}
+	}
+}
+
+/*
+ * Slab test, clipped to [0, t_max]. A ray parallel to a slab and in one
+ * of its planes gets 0 * inf = NaN there; it is inside that slab.
+ */
+bool CapsuleBVH::hitBox(const Node& node, const glm::vec3& origin,
+		const glm::vec3& inv_dir, float t_max, float& t_near) const
+{
+	glm::vec3 t0 = (node.lo - origin) * inv_dir;
+	glm::vec3 t1 = (node.hi - origin) * inv_dir;
+	glm::vec3 t_min = glm::min(t0, t1), t_far = glm::max(t0, t1);
+	for (int k = 0; k < 3; k++)
+		if (std::isnan(t0[k]) || std::isnan(t1[k])) {
+			t_min[k] = -std::numeric_limits<float>::infinity();
+			t_far[k] = std::numeric_limits<float>::infinity();
+		}
+	t_near = std::max(std::max(t_min.x, t_min.y), std::max(t_min.z, 0.0f));
+	float t_exit = std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, t_max));
+	return t_near <= t_exit;
+}
@@ -0,0 +1,104 @@
+#ifndef CAPSULE_BVH_H
+#define CAPSULE_BVH_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+/*
+ * Boxes are grown slightly past the radius so that rays grazing a capsule
+ * are not lost to rounding in the slab test.
+ */
+const float kBoxPadding = 1.001f;
+
+/*
+ * CapsuleBVH: bounding volume hierarchy over capsules, the segments
+ * [a[i], b[i]] swept by a sphere of the given radius.
+ *
+ * The tree shape is chosen once by build(). When the capsules move, e.g.
+ * for a new skeleton pose, refit() recomputes the boxes bottom up in
+ * linear time and keeps the shape. Nodes are stored depth first, so the
+ * left child of node i is i + 1.
+ */
+class CapsuleBVH {
+public:
+	void build(const std::vector<glm::vec3>& a, const std::vector<glm::vec3>& b,
+			float radius);
+	void refit(const std::vector<glm::vec3>& a, const std::vector<glm::vec3>& b,
+			float radius);
+	bool empty() const { return nodes_.empty(); }
+
+	/*
+	 * Closest capsule along the ray origin + t * dir, t >= 0. test(i, t)
+	 * is the exact test of capsule i; it returns whether the ray hits it
+	 * and at which t. Boxes are visited near first and skipped once they
+	 * start beyond the closest hit so far. Returns -1 if nothing is hit, and
+	 * the lowest index among equally close capsules.
+	 */
+	template<typename Test>
+	int raycast(const glm::vec3& origin, const glm::vec3& dir, float& t,
+			Test test) const;
+
+private:
+	struct Node {
+		glm::vec3 lo, hi;
+		int first, count; // Capsules of a leaf, count == 0 for inner nodes.
+		int right;
+	};
+	std::vector<Node> nodes_;
+	std::vector<int> items_;
+
+	int buildNode(const std::vector<glm::vec3>& centers, int first, int count);
+	bool hitBox(const Node& node, const glm::vec3& origin,
+			const glm::vec3& inv_dir, float t_max, float& t_near) const;
+};
+
+template<typename Test>
+int CapsuleBVH::raycast(const glm::vec3& origin, const glm::vec3& dir, float& t,
+		Test test) const
+{
+	int ret = -1;
+	float best = std::numeric_limits<float>::infinity();
+	if (nodes_.empty())
+		return ret;
+
+	glm::vec3 inv_dir = glm::vec3(1.0f) / dir;
+	float t_near;
+	int stack[64];
+	int top = 0;
+	if (hitBox(nodes_[0], origin, inv_dir, best, t_near))
+		stack[top++] = 0;
+	while (top > 0) {
+		const Node& node = nodes_[stack[--top]];
+		if (node.count > 0) {
+			for (int i = node.first; i < node.first + node.count; i++) {
+				float x;
+				if (test(items_[i], x) && (x < best || ret < 0 ||
+						(x == best && items_[i] < ret))) {
+					best = x;
+					ret = items_[i];
+				}
+			}
+			continue;
+		}
+
+		int near = &node - &nodes_[0] + 1, far = node.right;
+		float t_left, t_right;
+		bool left = hitBox(nodes_[near], origin, inv_dir, best, t_left);
+		bool right = hitBox(nodes_[far], origin, inv_dir, best, t_right);
+		if (left && right && t_right < t_left)
+			std::swap(near, far);
+		if (left && right) {
+			stack[top++] = far;
+			stack[top++] = near;
+		} else if (left || right) {
+			stack[top++] = left ? near : far;
+		}
+	}
+
+	t = best;
+	return ret;
+}
+
+#endif
@@ -7,6 +7,38 @@
 
 const float kCylinderRadius = 0.25;
 const int kMaxBones = 128;
+/*
+ * Influence budget applied at load: at most kMaxInfluences joints (1, 2 or
+ * 4) per vertex, and none weighted below kMinInfluenceWeight.
+ */
+const int kMaxInfluences = 4;
+const float kMinInfluenceWeight = 1e-3f;
+/*
+ * Partial skinning leaves vertices alone while their joints moved them by
+ * at most this much (in model units) since they were last skinned.
+ */
+const float kPoseTolerance = 1e-4f;
+/*
+ * IK dragging moves the tip of the picked bone with a chain of at most
+ * kIKChainLength bones. Every frame solves once for the latest mouse
+ * position, with kIKTimeBudget milliseconds and kIKMaxIterations sweeps
+ * to bring the tip within kIKTolerance. The budget is checked after every
+ * joint of a sweep, so a solve overruns it by at most one joint update.
+ */
+const int kIKChainLength = 4;
+const int kIKMaxIterations = 16;
+const float kIKTolerance = 0.01f;
+const float kIKTimeBudget = 2.0f;
+/*
+ * Crowd instances smaller than kLODScreenSize of the viewport height use a
+ * MeshLOD keeping at most kLODMaxBones bones, none deeper than
+ * kLODMaxDepth or with subtrees under kLODMinImportance of the total bone
+ * length.
+ */
+const float kLODScreenSize = 0.15f;
+const int kLODMaxDepth = 5;
+const float kLODMinImportance = 0.01f;
+const int kLODMaxBones = kMaxBones / 2;
 /*
  * Extra credit: what would happen if you set kNear to 1e-5? How to solve it?
  */
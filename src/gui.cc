@@ -63,9 +63,10 @@ void GUI::keyCallback(int key, int scancode, int action, int mods)
 			roll_speed = -roll_speed_;
 		else
 			roll_speed = roll_speed_;
-		if (bone_ptr != nullptr)
+		if (bone_ptr != nullptr) {
 			bone_ptr->roll(roll_speed);
-		pose_changed_ = true;
+			markBoneEdited();
+		}
 	} else if (key == GLFW_KEY_C && action != GLFW_RELEASE) {
 		fps_mode_ = !fps_mode_;
 	} else if (key == GLFW_KEY_LEFT_BRACKET && action == GLFW_RELEASE) {
@@ -78,6 +79,12 @@ void GUI::keyCallback(int key, int scancode, int action, int mods)
 		current_bone_ %= mesh_->getNumberOfBones();
 	} else if (key == GLFW_KEY_T && action != GLFW_RELEASE) {
 		transparent_ = !transparent_;
+	} else if (key == GLFW_KEY_K && action == GLFW_RELEASE) {
+		ik_mode_ = !ik_mode_;
+	} else if (key == GLFW_KEY_N && action == GLFW_RELEASE) {
+		mesh_->recompute_normals = !mesh_->recompute_normals;
+		pose_changed_ = true;
+		edited_bones_.clear();
 	}
 }
 
@@ -94,7 +101,6 @@ void GUI::mousePosCallback(double mouse_x, double mouse_y)
 	glm::vec3 mouse_direction = glm::normalize(glm::vec3(delta_x, delta_y, 0.0f));
 	glm::vec2 mouse_start = glm::vec2(last_x_, last_y_);
 	glm::vec2 mouse_end = glm::vec2(current_x_, current_y_);
-	glm::uvec4 viewport = glm::uvec4(0, 0, window_width_, window_height_);
 
 	bool drag_camera = drag_state_ && current_button_ == GLFW_MOUSE_BUTTON_RIGHT;
 	bool drag_bone = drag_state_ && current_button_ == GLFW_MOUSE_BUTTON_LEFT;
@@ -109,19 +115,26 @@ void GUI::mousePosCallback(double mouse_x, double mouse_y)
 		tangent_ = glm::column(orientation_, 0);
 		up_ = glm::column(orientation_, 1);
 		look_ = glm::column(orientation_, 2);
+	} else if (drag_bone && current_bone_ != -1 && ik_mode_) {
+		// Keep the tip at its depth and move it under the cursor.
+		glm::mat4 world = bone_ptr->transform();
+		glm::vec3 tip(world * glm::vec4(0.0f, 0.0f, bone_ptr->get_length(), 1.0f));
+		glm::vec3 dir = mouseRay();
+		float along = glm::dot(dir, look_);
+		if (std::abs(along) > 1e-6f) {
+			// Solved by solveIK() once per frame, for the latest event.
+			ik_target_ = eye_ + dir * (glm::dot(tip - eye_, look_) / along);
+			ik_bone_ = current_bone_;
+		}
 	} else if (drag_bone && current_bone_ != -1) {
 		glm::vec3 axis = glm::normalize(glm::cross(look_,
 				glm::vec3(mouse_direction.y, -mouse_direction.x, 0.0f)));
 		bone_ptr->rotate(rotation_speed_, axis);
-		pose_changed_ = true;
+		markBoneEdited();
 	}
 
     if (!drag_bone) {
-		glm::vec3 p = glm::unProject(glm::vec3(current_x_, current_y_, 0),
-			view_matrix_ * model_matrix_, projection_matrix_, viewport);
-		glm::vec3 q = glm::unProject(glm::vec3(current_x_, current_y_, 1),
-				view_matrix_ * model_matrix_, projection_matrix_, viewport);
-		glm::vec3 dir = glm::normalize(q - p);
+		glm::vec3 dir = mouseRay();
 
         Bone* bone = mesh_->skeleton->bone_inter(eye_, dir, kCylinderRadius);
         if (bone != nullptr) {
@@ -134,6 +147,17 @@ void GUI::mousePosCallback(double mouse_x, double mouse_y)
     }
 }
 
+void GUI::solveIK()
+{
+	if (ik_bone_ == -1)
+		return;
+	ik_stats_ = mesh_->skeleton->solve_ik(ik_bone_, ik_target_,
+			kIKChainLength, kIKMaxIterations, kIKTolerance,
+			kIKTimeBudget);
+	markBoneEdited(ik_stats_.top_bone);
+	ik_bone_ = -1;
+}
+
 void GUI::mouseButtonCallback(int button, int action, int mods)
 {
 	drag_state_ = (action == GLFW_PRESS);
@@ -174,6 +198,37 @@ bool GUI::setCurrentBone(int i)
 	return true;
 }
 
+void GUI::markBoneEdited()
+{
+	markBoneEdited(current_bone_);
+}
+
+void GUI::markBoneEdited(int bone)
+{
+	// A pose change already pending for the whole mesh stays a full one.
+	bool full = pose_changed_ && edited_bones_.empty();
+	pose_changed_ = true;
+	if (full)
+		return;
+	for (int edited : edited_bones_)
+		if (edited == bone)
+			return;
+	edited_bones_.push_back(bone);
+}
+
+/*
+ * Direction of the ray from the camera through the cursor.
+ */
+glm::vec3 GUI::mouseRay() const
+{
+	glm::uvec4 viewport = glm::uvec4(0, 0, window_width_, window_height_);
+	glm::vec3 p = glm::unProject(glm::vec3(current_x_, current_y_, 0),
+			view_matrix_ * model_matrix_, projection_matrix_, viewport);
+	glm::vec3 q = glm::unProject(glm::vec3(current_x_, current_y_, 1),
+			view_matrix_ * model_matrix_, projection_matrix_, viewport);
+	return glm::normalize(q - p);
+}
+
 bool GUI::captureWASDUPDOWN(int key, int action)
 {
 	if (key == GLFW_KEY_W) {
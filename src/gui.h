@@ -4,8 +4,9 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <GLFW/glfw3.h>
+#include <vector>
+#include "skeletal_sys.h"
 
-class Bone;
 class Mesh;
 
 /*
@@ -34,13 +35,27 @@ public:
 	glm::vec3 getCenter() const { return center_; }
 	const glm::vec3& getCamera() const { return eye_; }
 	bool isPoseDirty() const { return pose_changed_; }
-	void clearPose() { pose_changed_ = false; }
+	/*
+	 * Bones edited since the last clearPose(). Empty while the pose is
+	 * dirty means the whole pose must be refreshed.
+	 */
+	const std::vector<int>& getEditedBones() const { return edited_bones_; }
+	void clearPose() { pose_changed_ = false; edited_bones_.clear(); }
 	const float* getLightPositionPtr() const { return &light_position_[0]; }
 
 	int getCurrentBone() const { return current_bone_; }
 	bool setCurrentBone(int i);
 
 	bool isTransparent() const { return transparent_; }
+	/*
+	 * In IK mode dragging a bone sets a target for its tip, and solveIK()
+	 * moves the tip there with Skeleton::solve_ik(). Call it once per
+	 * frame, so that all mouse events of a frame share one solve and one
+	 * kIKTimeBudget. getIKStats() reports the last frame that solved.
+	 */
+	bool isIKMode() const { return ik_mode_; }
+	void solveIK();
+	const IKStats& getIKStats() const { return ik_stats_; }
 private:
 	GLFWwindow* window_;
 	Mesh* mesh_;
@@ -51,7 +66,12 @@ private:
 	bool drag_state_ = false;
 	bool fps_mode_ = false;
 	bool pose_changed_ = true;
+	std::vector<int> edited_bones_;
 	bool transparent_ = false;
+	bool ik_mode_ = false;
+	IKStats ik_stats_ = { 0, 0.0f, 0.0f, false, -1 };
+	int ik_bone_ = -1; // Bone with a pending ik_target_, or -1.
+	glm::vec3 ik_target_;
 	int current_bone_ = -1;
 	int current_button_ = -1;
 	float roll_speed_ = 0.1;
@@ -75,6 +95,9 @@ private:
 	glm::mat4 model_matrix_ = glm::mat4(1.0f);
 
 	bool captureWASDUPDOWN(int key, int action);
+	void markBoneEdited();
+	void markBoneEdited(int bone);
+	glm::vec3 mouseRay() const;
 
 };
 
@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -26,6 +27,10 @@ const char* vertex_shader =
 #include "shaders/default.vert"
 ;
 
+const char* object_vertex_shader =
+#include "shaders/object.vert"
+;
+
 const char* geometry_shader =
 #include "shaders/default.geom"
 ;
@@ -109,6 +114,7 @@ int main(int argc, char* argv[])
 	create_lattice_lines(form_v, form_l);
 
 	Mesh mesh;
+	mesh.verbose = true;
 	mesh.loadpmd(argv[1]);
 	mesh.skeleton->calc_joints(skeleton_v, skeleton_l);
 	std::cout << "Loaded object  with  " << mesh.vertices.size()
@@ -214,18 +220,19 @@ int main(int argc, char* argv[])
 	// FIXME: define more ShaderUniforms for RenderPass if you want to use it.
 	//		Otherwise, do whatever you like here
 
-	std::vector<glm::vec2>& uv_coordinates = mesh.uv_coordinates;
 	RenderDataInput object_pass_input;
-	object_pass_input.assign(0, "vertex_position", nullptr, mesh.vertices.size(), 4, GL_FLOAT);
-	object_pass_input.assign(1, "normal", mesh.vertex_normals.data(), mesh.vertex_normals.size(), 4, GL_FLOAT);
-	object_pass_input.assign(2, "uv", uv_coordinates.data(), uv_coordinates.size(), 2, GL_FLOAT);
+	// Compact layout: float3 positions, 10:10:10:2 normals and half UVs.
+	// Positions and normals are filled by the first skinning pass.
+	object_pass_input.assign(0, "vertex_position", nullptr, mesh.vertices.size(), 3, GL_FLOAT);
+	object_pass_input.assign(1, "normal", nullptr, mesh.vertices.size(), 4, GL_INT_2_10_10_10_REV, true);
+	object_pass_input.assign(2, "uv", mesh.uv_halves.data(), mesh.uv_halves.size(), 2, GL_HALF_FLOAT);
 	object_pass_input.assign_index(mesh.faces.data(), mesh.faces.size(), 3);
 	object_pass_input.useMaterials(mesh.materials);
 	RenderPass object_pass(-1,
 			object_pass_input,
 			{
-			  vertex_shader,
-			  geometry_shader,
+			  object_vertex_shader,
+			  nullptr,
 			  fragment_shader
 			},
 			{ std_model, std_view, std_proj,
@@ -270,6 +277,10 @@ int main(int argc, char* argv[])
 	bool draw_skeleton = true;
 	bool draw_object = true;
 	bool draw_cylinder = true;
+	std::vector<IndexRange> dirty_ranges;
+	bool object_vbo_valid = false;
+	bool object_vbo_recomputed = false; // Holds recomputed normals.
+	std::string shown_title = window_title;
 
 	while (!glfwWindowShouldClose(window)) {
 		// Setup some basic window stuff.
@@ -287,6 +298,23 @@ int main(int argc, char* argv[])
 
 		gui.updateMatrices();
 		mats = gui.getMatrixPointers();
+		gui.solveIK();
+
+		// Report the IK solve of the last dragged frame in the title
+		// while in IK mode.
+		std::string title = window_title;
+		if (gui.isIKMode()) {
+			const IKStats& ik = gui.getIKStats();
+			std::ostringstream ss;
+			ss << window_title << " - IK: " << ik.iterations
+			   << " iterations, " << ik.time_ms << " ms, error "
+			   << ik.error;
+			title = ss.str();
+		}
+		if (title != shown_title) {
+			glfwSetWindowTitle(window, title.c_str());
+			shown_title = title;
+		}
 
 		int current_bone = gui.getCurrentBone();
 #if 1
@@ -311,14 +339,44 @@ int main(int argc, char* argv[])
 		}
 		if (draw_object) {
 			if (gui.isPoseDirty()) {
-				mesh.updateAnimation();
-				object_pass.updateVBO(0,
-						mesh.animated_vertices.data(),
-						mesh.animated_vertices.size());
-				mesh.skeleton->move_joints(skeleton_v);
-				skeletal_pass.updateVBO(0,
-						skeleton_v.data(),
-						skeleton_v.size());
+				bool full = gui.getEditedBones().empty();
+				if (!mesh.recompute_normals) {
+					// Nothing else needs the CPU copies of the
+					// skinned mesh, so write the buffers in place.
+					// Without a list of edited bones the mesh
+					// finds the joints that moved by itself.
+					bool refill = !object_vbo_valid || object_vbo_recomputed;
+					VertexSink sink = object_pass.vertexSink();
+					object_vbo_valid = mesh.skinInto(sink, refill,
+							gui.getEditedBones(), dirty_ranges);
+					full = !object_vbo_valid;
+				}
+				if (full) {
+					mesh.updateAnimation();
+					object_pass.updateVBO(0,
+							mesh.animated_vertices.data(),
+							mesh.animated_vertices.size());
+					object_pass.updateVBO(1,
+							mesh.animated_normals.data(),
+							mesh.animated_normals.size());
+					object_vbo_valid = true;
+				} else if (mesh.recompute_normals) {
+					mesh.updateAnimation(gui.getEditedBones(), dirty_ranges);
+					for (const auto& range : dirty_ranges) {
+						object_pass.updateVBORange(0,
+								mesh.animated_vertices.data(),
+								range.begin, range.end - range.begin);
+						object_pass.updateVBORange(1,
+								mesh.animated_normals.data(),
+								range.begin, range.end - range.begin);
+					}
+				}
+				object_vbo_recomputed = mesh.recompute_normals;
+				IndexRange moved = mesh.skeleton->update_joints(skeleton_v);
+				if (moved.end > moved.begin)
+					skeletal_pass.updateVBORange(0,
+							skeleton_v.data(),
+							moved.begin, moved.end - moved.begin);
 #if 0
 				// For debugging if you need it.
 				for (int i = 0; i < 4; i++) {
@@ -0,0 +1,175 @@
+#include "mesh_optimizer.h"
+#include <cmath>
+#include <algorithm>
+
+namespace {
+	const int kCacheSize = 32;
+	const float kLastFaceScore = 0.75f;
+	const float kCacheDecayPower = 1.5f;
+	const float kValenceBoostScale = 2.0f;
+	const float kValenceBoostPower = 0.5f;
+
+	float vertex_score(int cache_pos, uint32_t remaining)
+	{
+		if (remaining == 0)
+			return -1.0f;
+		float score = 0.0f;
+		if (cache_pos >= 0) {
+			if (cache_pos < 3) {
+				score = kLastFaceScore;
+			} else {
+				float scale = 1.0f / (kCacheSize - 3);
+				score = std::pow(1.0f - (cache_pos - 3) * scale, kCacheDecayPower);
+			}
+		}
+		return score + kValenceBoostScale * std::pow(float(remaining), -kValenceBoostPower);
+	}
+}
+
+void optimize_vertex_cache(std::vector<glm::uvec3>& faces,
+		std::vector<FaceRange> ranges, size_t nvertices)
+{
+	size_t nfaces = faces.size();
+	std::sort(ranges.begin(), ranges.end());
+
+	// Faces around each vertex for the whole mesh, in face order, so the
+	// faces of a range are the next ones after head[v]. The ones still to
+	// be emitted are face_list[head[v], head[v] + remaining[v]).
+	std::vector<uint32_t> offsets(nvertices + 1, 0);
+	for (const auto& face : faces)
+		for (int k = 0; k < 3; k++)
+			offsets[face[k] + 1]++;
+	for (size_t v = 0; v < nvertices; v++)
+		offsets[v + 1] += offsets[v];
+	std::vector<uint32_t> head(offsets.begin(), offsets.end() - 1);
+	std::vector<uint32_t> face_list(offsets[nvertices]);
+	for (size_t f = 0; f < nfaces; f++)
+		for (int k = 0; k < 3; k++)
+			face_list[head[faces[f][k]]++] = f;
+	std::copy(offsets.begin(), offsets.end() - 1, head.begin());
+
+	std::vector<uint32_t> remaining(nvertices, 0);
+	std::vector<int> cache_pos(nvertices, -1);
+	std::vector<float> scores(nvertices, 0.0f);
+	std::vector<float> face_scores(nfaces, 0.0f);
+	std::vector<bool> emitted(nfaces, false);
+	std::vector<glm::uvec3> order;
+	std::vector<uint32_t> cache, next_cache;
+
+	size_t done = 0;
+	for (const auto& range : ranges) {
+		size_t begin = std::max(range.first, done);
+		size_t end = std::min(range.second, nfaces);
+		if (end <= begin)
+			continue;
+		done = end;
+
+		for (size_t f = begin; f < end; f++)
+			for (int k = 0; k < 3; k++) {
+				uint32_t v = faces[f][k];
+				while (face_list[head[v]] < begin)
+					head[v]++;
+				remaining[v]++;
+			}
+		for (size_t f = begin; f < end; f++)
+			for (int k = 0; k < 3; k++) {
+				uint32_t v = faces[f][k];
+				scores[v] = vertex_score(-1, remaining[v]);
+			}
+		for (size_t f = begin; f < end; f++) {
+			const glm::uvec3& face = faces[f];
+			face_scores[f] = scores[face[0]] + scores[face[1]] + scores[face[2]];
+		}
+
+		order.clear();
+		cache.clear();
+		// Dead ends restart at the first face not yet emitted, so the
+		// cursor only moves forward over the range.
+		size_t cursor = begin;
+		long best = -1;
+		while (order.size() < end - begin) {
+			if (best < 0) {
+				while (emitted[cursor])
+					cursor++;
+				best = cursor;
+			}
+			const glm::uvec3 face = faces[best];
+			order.push_back(face);
+			emitted[best] = true;
+
+			next_cache.clear();
+			for (int k = 0; k < 3; k++) {
+				uint32_t v = face[k];
+				uint32_t* list = &face_list[head[v]];
+				uint32_t n = remaining[v];
+				uint32_t i = std::find(list, list + n, uint32_t(best)) - list;
+				std::swap(list[i], list[n - 1]);
+				remaining[v]--;
+				next_cache.push_back(v);
+			}
+			for (auto v : cache)
+				if (v != face[0] && v != face[1] && v != face[2])
+					next_cache.push_back(v);
+			cache.swap(next_cache);
+
+			for (size_t i = 0; i < cache.size(); i++) {
+				uint32_t v = cache[i];
+				cache_pos[v] = i < size_t(kCacheSize) ? int(i) : -1;
+				float score = vertex_score(cache_pos[v], remaining[v]);
+				float delta = score - scores[v];
+				scores[v] = score;
+				for (uint32_t j = head[v]; j < head[v] + remaining[v]; j++)
+					face_scores[face_list[j]] += delta;
+			}
+			if (cache.size() > size_t(kCacheSize))
+				cache.resize(kCacheSize);
+
+			best = -1;
+			for (auto v : cache)
+				for (uint32_t j = head[v]; j < head[v] + remaining[v]; j++) {
+					uint32_t f = face_list[j];
+					if (best < 0 || face_scores[f] > face_scores[best])
+						best = f;
+				}
+		}
+		std::copy(order.begin(), order.end(), faces.begin() + begin);
+		for (auto v : cache)
+			cache_pos[v] = -1;
+	}
+}
+
+void reorder_vertices_by_first_use(std::vector<glm::uvec3>& faces,
+		size_t nvertices, std::vector<uint32_t>& remap)
+{
+	const uint32_t unused = ~0u;
+	remap.assign(nvertices, unused);
+	uint32_t next = 0;
+	for (auto& face : faces)
+		for (int k = 0; k < 3; k++) {
+			uint32_t& to = remap[face[k]];
+			if (to == unused)
+				to = next++;
+			face[k] = to;
+		}
+	for (auto& to : remap)
+		if (to == unused)
+			to = next++;
+}
+
+float average_cache_miss_ratio(const std::vector<glm::uvec3>& faces,
+		size_t nvertices, size_t cache_size)
+{
+	if (faces.empty())
+		return 0.0f;
+	// Entry time of each vertex into the FIFO, so a vertex is cached
+	// while fewer than cache_size misses happened since.
+	std::vector<size_t> entered(nvertices, 0);
+	size_t misses = 0;
+	for (const auto& face : faces)
+		for (int k = 0; k < 3; k++) {
+			size_t& t = entered[face[k]];
+			if (t == 0 || misses - t >= cache_size)
+				t = ++misses;
+		}
+	return float(misses) / faces.size();
+}
@@ -0,0 +1,50 @@
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+typedef std::pair<size_t, size_t> FaceRange;
+
+/*
+ * Reorders the faces within each range [first, second) for the
+ * post-transform vertex cache, with Tom Forsyth's linear-speed greedy
+ * algorithm. Faces never leave their range, so material face ranges stay
+ * valid. The vertex to face adjacency is built once for all ranges.
+ */
+void optimize_vertex_cache(std::vector<glm::uvec3>& faces,
+		std::vector<FaceRange> ranges, size_t nvertices);
+
+/*
+ * Renumbers vertices in the order the faces first use them, rewriting the
+ * faces. remap[old] is the new index; vertices used by no face are moved
+ * to the end in their original order.
+ */
+void reorder_vertices_by_first_use(std::vector<glm::uvec3>& faces,
+		size_t nvertices, std::vector<uint32_t>& remap);
+
+/*
+ * Moves data[old] to data[remap[old]].
+ */
+template<typename T>
+void remap_vertex_array(std::vector<T>& data, const std::vector<uint32_t>& remap)
+{
+	if (data.size() != remap.size())
+		return;
+	std::vector<T> old;
+	old.swap(data);
+	data.resize(old.size());
+	for (size_t v = 0; v < old.size(); v++)
+		data[remap[v]] = old[v];
+}
+
+/*
+ * Average cache miss ratio (vertex transforms per face) of the faces on a
+ * FIFO cache of the given size.
+ */
+float average_cache_miss_ratio(const std::vector<glm::uvec3>& faces,
+		size_t nvertices, size_t cache_size = 16);
+
+#endif
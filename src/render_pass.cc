@@ -19,10 +19,11 @@ RenderInputMeta::RenderInputMeta(int _position,
 				const void *_data,
 				size_t _nelements,
 				size_t _element_length,
-				int _element_type)
+				int _element_type,
+				bool _normalized)
 	:position(_position), name(_name), data(_data),
 	nelements(_nelements), element_length(_element_length),
-	element_type(_element_type) {}
+	element_type(_element_type), normalized(_normalized) {}
 
 RenderDataInput::RenderDataInput() {}
 
@@ -64,7 +65,7 @@ RenderPass::RenderPass(int vao, // -1: create new VAO, otherwise use given VAO
 		CHECK_GL_ERROR(glVertexAttribPointer(meta.position,
 					meta.element_length,
 					meta.element_type,
-					GL_FALSE, 0, 0));
+					meta.normalized ? GL_TRUE : GL_FALSE, 0, 0));
 		CHECK_GL_ERROR(glEnableVertexAttribArray(meta.position));
 		// ... because we need program to bind location
 		CHECK_GL_ERROR(glBindAttribLocation(sp_, meta.position, meta.name.c_str()));
@@ -227,18 +228,19 @@ RenderPass::~RenderPass()
 	// TODO: Free resources
 }
 
-void RenderPass::updateVBO(int position, const void* data, size_t size)
+int RenderPass::findBuffer(int position) const
 {
-	int bufferid = -1;
 	for (int i = 0; i < input_.getNBuffers(); i++) {
 		auto meta = input_.getBufferMeta(i);
-		if (meta.position == position) {
-			bufferid = i;
-			break;
-		}
+		if (meta.position == position)
+			return i;
 	}
-	if (bufferid < 0)
-		throw __func__+std::string(": error, can't find buffer with position ")+std::to_string(position);
+	throw __func__+std::string(": error, can't find buffer with position ")+std::to_string(position);
+}
+
+void RenderPass::updateVBO(int position, const void* data, size_t size)
+{
+	int bufferid = findBuffer(position);
 	auto meta = input_.getBufferMeta(bufferid);
 	CHECK_GL_ERROR(glBindBuffer(GL_ARRAY_BUFFER, glbuffers_[bufferid]));
 	CHECK_GL_ERROR(glBufferData(GL_ARRAY_BUFFER,
@@ -246,6 +248,72 @@ void RenderPass::updateVBO(int position, const void* data, size_t size)
 				data, GL_STATIC_DRAW));
 }
 
+void RenderPass::updateVBORange(int position, const void* data, size_t offset, size_t size)
+{
+	int bufferid = findBuffer(position);
+	auto meta = input_.getBufferMeta(bufferid);
+	size_t element_size = meta.getElementSize();
+	CHECK_GL_ERROR(glBindBuffer(GL_ARRAY_BUFFER, glbuffers_[bufferid]));
+	CHECK_GL_ERROR(glBufferSubData(GL_ARRAY_BUFFER,
+				offset * element_size,
+				size * element_size,
+				(const char*)data + offset * element_size));
+}
+
+void* RenderPass::mapVBORange(int position, size_t offset, size_t nelement)
+{
+	int bufferid = findBuffer(position);
+	auto meta = input_.getBufferMeta(bufferid);
+	size_t element_size = meta.getElementSize();
+	// Orphan the whole store when all of it is rewritten.
+	GLbitfield access = GL_MAP_WRITE_BIT;
+	if (offset == 0 && nelement >= meta.nelements)
+		access |= GL_MAP_INVALIDATE_BUFFER_BIT;
+	else
+		access |= GL_MAP_INVALIDATE_RANGE_BIT;
+	void* ptr = nullptr;
+	CHECK_GL_ERROR(glBindBuffer(GL_ARRAY_BUFFER, glbuffers_[bufferid]));
+	CHECK_GL_ERROR(ptr = glMapBufferRange(GL_ARRAY_BUFFER,
+				offset * element_size,
+				nelement * element_size,
+				access));
+	return ptr;
+}
+
+bool RenderPass::unmapVBO(int position)
+{
+	int bufferid = findBuffer(position);
+	GLboolean ok = GL_FALSE;
+	CHECK_GL_ERROR(glBindBuffer(GL_ARRAY_BUFFER, glbuffers_[bufferid]));
+	CHECK_GL_ERROR(ok = glUnmapBuffer(GL_ARRAY_BUFFER));
+	return ok == GL_TRUE;
+}
+
+VertexSink RenderPass::vertexSink(int positions, int normals)
+{
+	VertexSink sink;
+	sink.map = [this, positions, normals](const IndexRange& range,
+			glm::vec3*& p, uint32_t*& n) {
+		size_t nelement = range.end - range.begin;
+		void* pbuf = mapVBORange(positions, range.begin, nelement);
+		void* nbuf = pbuf ? mapVBORange(normals, range.begin, nelement) : nullptr;
+		if (!nbuf) {
+			if (pbuf)
+				unmapVBO(positions);
+			return false;
+		}
+		// Indexed by vertex id, as Mesh::skinInto() writes them.
+		p = (glm::vec3*)pbuf - range.begin;
+		n = (uint32_t*)nbuf - range.begin;
+		return true;
+	};
+	sink.unmap = [this, positions, normals]() {
+		bool ok = unmapVBO(positions);
+		return unmapVBO(normals) && ok;
+	};
+	return sink;
+}
+
 void RenderPass::setup()
 {
 	// Switch to our object VAO.
@@ -309,9 +377,11 @@ void RenderDataInput::assign(int position,
 							const void *data,
 							size_t nelements,
 							size_t element_length,
-							int element_type)
+							int element_type,
+							bool normalized)
 {
-	meta_.emplace_back(position, name, data, nelements, element_length, element_type);
+	meta_.emplace_back(position, name, data, nelements, element_length,
+			element_type, normalized);
 }
 
 void RenderDataInput::assign_index(const void *data, size_t nelements, size_t element_length)
@@ -335,7 +405,13 @@ size_t RenderInputMeta::getElementSize() const
 		element_size = 4;
 	else if (element_type == GL_UNSIGNED_INT)
 		element_size = 4;
+	else if (element_type == GL_HALF_FLOAT)
+		element_size = 2;
+	else if (element_type == GL_INT_2_10_10_10_REV ||
+		 element_type == GL_UNSIGNED_INT_2_10_10_10_REV)
+		return 4; // All components in one word.
 	return element_size * element_length;
 }
 
 std::map<const char*, unsigned> RenderPass::shader_cache_;
+
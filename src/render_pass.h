@@ -18,6 +18,7 @@
 #include <map>
 #include <functional>
 #include <material.h>
+#include "skinning.h"
 
 /*
  * ShaderUniform: description of a uniform in a shader program.
@@ -55,6 +56,7 @@ struct RenderInputMeta {
 	size_t nelements = 0;
 	size_t element_length = 0;
 	int element_type = 0;
+	bool normalized = false;
 
 	size_t getElementSize() const; // simple check: return 12 (3 * 4 bytes) for float3
 	RenderInputMeta();
@@ -63,7 +65,8 @@ struct RenderInputMeta {
 				const void *_data,
 				size_t _nelements,
 				size_t _element_length,
-				int _element_type);
+				int _element_type,
+				bool _normalized = false);
 };
 
 /*
@@ -79,14 +82,17 @@ public:
 	 *	  name: glBindAttribLocation name
 	 *	  nelements: number of elements
 	 *	  element_length: element dimension, e.g. for vec3 it's 3
-	 *	  element_type: GL_FLOAT or GL_UNSIGNED_INT
+	 *	  element_type: GL_FLOAT, GL_UNSIGNED_INT, GL_HALF_FLOAT, or the
+	 *	                packed GL_INT_2_10_10_10_REV (element_length 4)
+	 *	  normalized: map integer data to [-1, 1] or [0, 1]
 	 */
 	void assign(int position,
 				const std::string& name,
 				const void *data,
 				size_t nelements,
 				size_t element_length,
-				int element_type);
+				int element_type,
+				bool normalized = false);
 	/*
 	 * assign_index: assign the index buffer for vertices
 	 * This will bind the data to GL_ELEMENT_ARRAY_BUFFER
@@ -136,6 +142,26 @@ public:
 
 	unsigned getVAO() const { return unsigned(vao_); }
 	void updateVBO(int position, const void* data, size_t nelement);
+	/*
+	 * updateVBORange: overwrite elements [offset, offset + nelement) of an
+	 * existing buffer. data points to the first element of the whole array.
+	 */
+	void updateVBORange(int position, const void* data, size_t offset, size_t nelement);
+	/*
+	 * mapVBORange: map elements [offset, offset + nelement) of a buffer
+	 * for writing, so that they can be filled in place without a staging
+	 * copy. The old contents of the range are invalidated and every
+	 * element in it must be written; the rest of the buffer is kept.
+	 * Pair every call with unmapVBO() before drawing; unmapVBO returns
+	 * false if the contents were lost and must be written again.
+	 */
+	void* mapVBORange(int position, size_t offset, size_t nelement);
+	bool unmapVBO(int position);
+	/*
+	 * vertexSink: a sink for Mesh::skinInto() that maps vertex ranges of
+	 * the given position and packed normal buffers.
+	 */
+	VertexSink vertexSink(int positions = 0, int normals = 1);
 	void setup();
 	/*
  	* Note: here we don't have an unified render() function, because the
@@ -151,6 +177,7 @@ public:
 	 */
 	bool renderWithMaterial(int i); // return false if material id is invalid
 private:
+	int findBuffer(int position) const;
 	void initMaterialUniform();
 	void createMaterialTexture();
 
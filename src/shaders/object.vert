@@ -0,0 +1,24 @@
+R"zzz(
+#version 330 core
+uniform mat4 projection;
+uniform mat4 model;
+uniform mat4 view;
+uniform vec4 light_position;
+uniform vec3 camera_position;
+in vec4 vertex_position;
+in vec4 normal;
+in vec2 uv;
+out vec4 light_direction;
+out vec4 camera_direction;
+out vec4 world_position;
+out vec4 vertex_normal;
+out vec2 uv_coords;
+void main() {
+	world_position = vertex_position;
+	light_direction = normalize(light_position - vertex_position);
+	camera_direction = normalize(vec4(camera_position, 1.0) - vertex_position);
+	vertex_normal = normal;
+	uv_coords = uv;
+	gl_Position = projection * view * model * vertex_position;
+}
+)zzz"
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <chrono>
 #include <glm/gtx/transform.hpp>
 #include <unordered_map>
 #include "config.h"
@@ -7,224 +8,549 @@
 #include "skeletal_sys.h"
 #include <mmdadapter.h>
 
-Skeleton::Skeleton() : root(nullptr) {  }
+namespace {
+
+/*
+ * Parallel loops over fewer items than this run on the calling thread.
+ */
+const int kMinParallelBones = 256;
+
+/*
+ * See Skeleton::bone_rotation for the mirrored first column.
+ */
+glm::mat4 local_matrix(const glm::quat& rotation, const glm::vec3& translation)
+{
+	glm::mat4 local(glm::mat3_cast(rotation));
+	local[0] = -local[0];
+	local[3] = glm::vec4(translation, 1.0f);
+	return local;
+}
+
+}
 
-Skeleton::Skeleton(Bone* root) : root(root) {  }
+Skeleton::Skeleton() : root(nullptr) {  }
 
 Skeleton::Skeleton(const std::vector<glm::vec3>& offset, const std::vector<int>& parent, const std::vector<SparseTuple>& weights)
 {
 	this->weights = weights;
-	std::vector<Joint*> joints;
 	root = nullptr;
 	size_t r_n = 0;
 
 	size_t N = std::max(offset.size(), parent.size());
+	joint_vector.reserve(N + 1);
 	for (size_t i = 0; i < N; i++) {
-		joints.push_back(new Joint(offset[i], parent[i]));
-		if (parent[i] == -1) r_n = joints.size() - 1;
+		joint_vector.emplace_back(offset[i], parent[i]);
+		if (parent[i] == -1) r_n = i;
 	}
-	joints.push_back(new Joint(glm::vec3(0.0f, 0.0f, 0.0f), -1));
+	joint_vector.emplace_back(glm::vec3(0.0f, 0.0f, 0.0f), -1);
+	joint_bone.assign(N, 0);
+	joint_tip.assign(N, true);
+
+	init_bones(r_n);
+}
 
-	root = new Bone(joints[joints.size() - 1], joints[r_n], nullptr);
-	bone_vector.push_back(root);
-	bone_map.insert({0, root});
-	std::vector<Bone*> head_bones = init_bone(joints, root, r_n);
-	root->add_leaves(head_bones);
+Skeleton::~Skeleton() { }
 
+Bone* Skeleton::get_at(size_t i)
+{
+	return (i < bone_vector.size()) ? &bone_vector[i] : nullptr;
 }
 
-Skeleton::~Skeleton()
+Bone* Skeleton::bone_inter(glm::vec3 b, glm::vec3 dir, float y)
 {
-	if (root != nullptr) delete root;
+	float distance;
+	return bone_inter(b, dir, y, distance);
 }
 
-Bone* Skeleton::get_at(size_t i)
+/*
+ * The bone whose cylinder of radius y the ray b + x * dir enters first,
+ * and the x where it does, or nullptr.
+ */
+Bone* Skeleton::bone_inter(glm::vec3 b, glm::vec3 dir, float y, float& distance)
 {
-	return (i < bone_vector.size()) ? bone_vector[i] : nullptr;
+	update_world();
+	if (bvh_stale || y != bvh_radius)
+		refit_bvh(y);
+
+	int hit = bone_bvh.raycast(b, dir, distance,
+			[this, &b, &dir, y](int i, float& x) {
+				return bone_vector[i].intersect(b, dir, y, x);
+			});
+	return (hit >= 0) ? &bone_vector[hit] : nullptr;
 }
 
-Bone* Skeleton::bone_inter(glm::vec3 b, glm::vec3 dir, float y)
+void Skeleton::refit_bvh(float radius)
 {
-	float lim = std::numeric_limits<float>::infinity();
-	Bone* ret = NULL;
-
-	for (auto it = bone_vector.begin(); it != bone_vector.end(); it++) {
-		float x = 0;
-		Bone* bone = *it;
-		if (bone->intersect(b, dir, y, x)) {
-			if (x < lim || ret == NULL) {
-				lim = x;
-				ret = bone;
-			}
+	std::vector<glm::vec3> beg(bone_vector.size()), end(bone_vector.size());
+	for (size_t i = 0; i < bone_vector.size(); i++) {
+		beg[i] = glm::vec3(bone_world[i][3]);
+		end[i] = glm::vec3(bone_world[i] * glm::vec4(0.0f, 0.0f, bone_length[i], 1.0f));
+	}
+	if (bone_bvh.empty())
+		bone_bvh.build(beg, end, radius);
+	else
+		bone_bvh.refit(beg, end, radius);
+	bvh_radius = radius;
+	bvh_stale = false;
+}
+
+/*
+ * Builds the bones below the root joint r_n depth first, children in joint
+ * order. The children of every joint are listed up front so that each
+ * joint is visited once, and an explicit stack replaces the recursion.
+ */
+void Skeleton::init_bones(int r_n)
+{
+	std::vector<Joint>& joints = joint_vector;
+	size_t N = joint_bone.size();
+	std::vector<uint32_t> child_offsets(N + 1, 0);
+	std::vector<uint32_t> children(N);
+	for (size_t i = 0; i < N; i++)
+		if (joints[i].pid >= 0)
+			child_offsets[joints[i].pid + 1]++;
+	for (size_t i = 0; i < N; i++)
+		child_offsets[i + 1] += child_offsets[i];
+	std::vector<uint32_t> fill(child_offsets.begin(), child_offsets.end() - 1);
+	for (size_t i = 0; i < N; i++)
+		if (joints[i].pid >= 0)
+			children[fill[joints[i].pid]++] = i;
+
+	// One allocation per array: there are at most N + 1 bones.
+	bone_vector.reserve(N + 1);
+	bone_parent.reserve(N + 1);
+	bone_translation.reserve(N + 1);
+	bone_rotation.reserve(N + 1);
+	bone_world.reserve(N + 1);
+	bone_dirty.reserve(N + 1);
+	bone_length.reserve(N + 1);
+	bind_start.reserve(N + 1);
+	subtree_end.assign(N + 1, 0);
+	add_bone(&joints[N], &joints[r_n], -1);
+	root = &bone_vector[0];
+
+	struct Visit {
+		int joint, bid;
+		uint32_t next_child;
+	};
+	std::stack<Visit> visits;
+	visits.push({r_n, 0, child_offsets[r_n]});
+	while (!visits.empty()) {
+		Visit& top = visits.top();
+		if (top.next_child == child_offsets[top.joint + 1]) {
+			subtree_end[top.bid] = bone_vector.size();
+			visits.pop();
+			continue;
 		}
+		int curr = top.joint, parent_bid = top.bid;
+		int i = children[top.next_child++];
+
+		int bid = add_bone(&joints[curr], &joints[i], parent_bid);
+		if (joint_tip[curr])
+			joint_bone[curr] = bid;
+		joint_tip[curr] = false;
+		joint_bone[i] = bid;
+
+		visits.push({i, bid, child_offsets[i]});
 	}
+	subtree_end.resize(bone_vector.size());
 
-	return ret;
+	std::vector<uint32_t> depth(bone_vector.size(), 0);
+	uint32_t max_depth = 0;
+	for (size_t i = 1; i < bone_vector.size(); i++) {
+		depth[i] = depth[bone_parent[i]] + 1;
+		max_depth = std::max(max_depth, depth[i]);
+	}
+	level_offsets.assign(max_depth + 2, 0);
+	for (uint32_t d : depth)
+		level_offsets[d + 1]++;
+	for (size_t d = 0; d <= max_depth; d++)
+		level_offsets[d + 1] += level_offsets[d];
+	level_bones.resize(bone_vector.size());
+	std::vector<uint32_t> fill_level(level_offsets.begin(), level_offsets.end() - 1);
+	for (size_t i = 0; i < bone_vector.size(); i++)
+		level_bones[fill_level[depth[i]]++] = i;
 }
 
-std::vector<Bone*> Skeleton::init_bone(std::vector<Joint*> joints, Bone* root_bone, int r_n)
+/*
+ * Appends bone i after its parent, posed as in the bind pose: starting at
+ * the first joint and pointing at the last one. Returns its index.
+ */
+int Skeleton::add_bone(Joint* first, Joint* last, int parent)
 {
-	Joint* curr = joints[r_n];
-	Joint* next = nullptr;
+	int i = bone_vector.size();
+	glm::mat4 parent_world(1.0f);
+	glm::vec3 start = first->offset;
+	if (parent >= 0) {
+		parent_world = bone_world[parent];
+		start += bind_start[parent];
+	}
+	glm::mat3 parent_r(parent_world);
+	glm::vec3 parent_t(parent_world[3]);
 
-	std::vector<Bone*> ret;
+	glm::vec3 t = glm::normalize(glm::transpose(parent_r) * last->offset);
+	glm::vec3 n = t;
+	if (std::abs(n.x) <= std::abs(n.y) && std::abs(n.x) <= std::abs(n.z))
+		n = glm::vec3(1.0f, 0.0f, 0.0f);
+	else if (std::abs(n.y) <= std::abs(n.x) && std::abs(n.y) <= std::abs(n.z))
+		n = glm::vec3(0.0f, 1.0f, 0.0f);
+	else
+		n = glm::vec3(0.0f, 0.0f, 1.0f);
+	n = glm::normalize(glm::cross(t, n));
+	glm::vec3 b = glm::normalize(glm::cross(t, n));
+
+	glm::mat3 rotation(-b, n, t);
+
+	bone_parent.push_back(parent);
+	bone_translation.push_back(glm::transpose(parent_r) * (start - parent_t));
+	bone_rotation.push_back(glm::normalize(glm::quat_cast(rotation)));
+	bone_world.push_back(parent_world * local_matrix(bone_rotation[i], bone_translation[i]));
+	bone_dirty.push_back(false);
+	bone_length.push_back(glm::length(last->offset));
+	bind_start.push_back(start);
+	bone_vector.emplace_back(this, i, first, last);
+	return i;
+}
 
-	for (size_t i = 0; i < joints.size(); i++) {
-		next = joints[i];
-		if (r_n == next->pid) {
-			Bone* curr_bone = new Bone(curr, next, root_bone);
-			bone_vector.push_back(curr_bone);
-			bone_map.insert({curr_bone->getId(), curr_bone});
-			curr_bone->add_leaves(init_bone(joints, curr_bone, i));
+void Skeleton::mark_dirty(int bone)
+{
+	for (int i = bone; i < subtree_end[bone]; i++)
+		bone_dirty[i] = true;
+	dirty_begin = std::min(dirty_begin, size_t(bone));
+}
 
-			ret.push_back(curr_bone);
-		}
+/*
+ * Parents come before their children in bone_vector, so one pass in order
+ * brings every dirty world transform up to date.
+ */
+void Skeleton::update_world()
+{
+	if (dirty_begin >= bone_vector.size())
+		return;
+
+	for (size_t i = dirty_begin; i < bone_vector.size(); i++) {
+		if (!bone_dirty[i])
+			continue;
+		glm::mat4 local = local_matrix(bone_rotation[i], bone_translation[i]);
+		glm::mat4& world = bone_world[i];
+		world = (bone_parent[i] >= 0) ? bone_world[bone_parent[i]] * local : local;
+		bone_dirty[i] = false;
+		moved_end = std::max(moved_end, i + 1);
 	}
-
-	return ret;
+	moved_begin = std::min(moved_begin, dirty_begin);
+	dirty_begin = SIZE_MAX;
+	bvh_stale = true;
 }
 
+/*
+ * Appends the two end points of every bone, and a line between them, to
+ * points and lines. Bone i owns the points 2i and 2i + 1 of a buffer
+ * filled from empty, which move_joints() and update_joints() rewrite.
+ */
 void Skeleton::calc_joints(std::vector<glm::vec4>& points, std::vector<glm::uvec2>& lines)
 {
-	root->_calc_joints(points, lines, glm::mat4(1.0f));
+	update_world();
+	points.reserve(points.size() + 2 * bone_vector.size());
+	for (size_t i = 0; i < bone_vector.size(); i++) {
+		points.push_back(bone_world[i][3]);
+		points.push_back(bone_world[i] * glm::vec4(0.0f, 0.0f, bone_length[i], 1.0f));
+		lines.push_back(glm::uvec2(points.size() - 2, points.size() - 1));
+	}
+	moved_begin = SIZE_MAX;
+	moved_end = 0;
 }
 
 void Skeleton::move_joints(std::vector<glm::vec4>& points)
 {
-	points.clear();
-	std::vector<glm::uvec2> lines;
-	calc_joints(points, lines);
+	update_world();
+	points.resize(2 * bone_vector.size());
+	for (size_t i = 0; i < bone_vector.size(); i++) {
+		points[2 * i] = bone_world[i][3];
+		points[2 * i + 1] = bone_world[i] * glm::vec4(0.0f, 0.0f, bone_length[i], 1.0f);
+	}
+	moved_begin = SIZE_MAX;
+	moved_end = 0;
 }
 
-//#####################################################################//
+/*
+ * Rewrites the points of the bones that moved since points were last
+ * filled, and returns the range of points rewritten.
+ */
+IndexRange Skeleton::update_joints(std::vector<glm::vec4>& points)
+{
+	update_world();
+	if (points.size() != 2 * bone_vector.size()) {
+		move_joints(points);
+		return IndexRange{0, points.size()};
+	}
 
-Bone::Bone(Joint* first, Joint* last, Bone* head)
-	: first_joint(first), last_joint(last), root(head),
-	rotation(1.0f), transformation(1.0f), S(1.0f),
-	length(glm::length(last_joint->offset)),
-	id(bone_id++)
+	IndexRange ret{0, 0};
+	if (moved_begin < moved_end) {
+		for (size_t i = moved_begin; i < moved_end; i++) {
+			points[2 * i] = bone_world[i][3];
+			points[2 * i + 1] = bone_world[i] * glm::vec4(0.0f, 0.0f, bone_length[i], 1.0f);
+		}
+		ret = IndexRange{2 * moved_begin, 2 * moved_end};
+	}
+	moved_begin = SIZE_MAX;
+	moved_end = 0;
+	return ret;
+}
+
+/*
+ * World transforms of all bones in bone_vector order.
+ */
+void Skeleton::calc_transforms(std::vector<glm::mat4>& world)
 {
-	update();
+	update_world();
+	world = bone_world;
 }
 
-Bone::~Bone()
+void Skeleton::joint_frames(std::vector<glm::mat4>& frames)
 {
-	for (auto it = leaves.begin(); it != leaves.end(); it++)
-		delete (*it);
+	update_world();
+	joint_frames(bone_world, frames);
+}
 
-	if (leaves.size() == 0)
-		delete last_joint;
-	delete first_joint;
+/*
+ * Joint frames of a pose with the given world matrices.
+ */
+void Skeleton::joint_frames(const std::vector<glm::mat4>& world,
+		std::vector<glm::mat4>& frames) const
+{
+	frames.resize(joint_bone.size());
+	for (size_t i = 0; i < joint_bone.size(); i++) {
+		frames[i] = world[joint_bone[i]];
+		if (joint_tip[i])
+			frames[i] *= glm::translate(glm::vec3(0.0f, 0.0f, bone_length[joint_bone[i]]));
+	}
 }
 
-void Bone::update()
+void Skeleton::get_pose(SkeletonPose& pose)
 {
-	glm::mat4 root_t(1.0f);
-	if (root != nullptr)
-		root_t = root->transform();
-	glm::mat4 root_r(1.0f);
-	if (root != nullptr)
-		root_r = root->rotate();
-
-	glm::mat4 root_t_inv = glm::inverse(root_t);
-	glm::vec4 v = root_t_inv * first_w();
-	transformation = glm::translate(glm::vec3(v));
-
-	t = glm::normalize(glm::vec3(glm::transpose(root_r) * glm::vec4(last_joint->offset, 0.0f)));
-	n = t;
-	if (std::abs(n.x) <= std::abs(n.y) && std::abs(n.x) <= std::abs(n.z))
-		n = glm::vec3(1.0f, 0.0f, 0.0f);
-	else if (std::abs(n.y) <= std::abs(n.x) && std::abs(n.y) <= std::abs(n.z))
-		n = glm::vec3(0.0f, 1.0f, 0.0f);
-	else
-		n = glm::vec3(0.0f, 0.0f, 1.0f);
-	n = glm::normalize(glm::cross(t, n));
-	b = glm::normalize(glm::cross(t, n));
-	rotation[0] = glm::vec4(b, 0.0f);
-	rotation[1] = glm::vec4(n, 0.0f);
-	rotation[2] = glm::vec4(t, 0.0f);
-	rotation[3] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
-	S = rotation, tS = t, nS = n, bS = b;
+	update_world();
+	pose.rotation = bone_rotation;
+	pose.translation = bone_translation;
+	pose.world = bone_world;
 }
 
-void Bone::add_leaf(Bone* leaf)
+void Skeleton::evaluate_poses(const std::vector<SkeletonPose*>& poses,
+		const SkeletonLOD* lod) const
 {
-	leaves.push_back(leaf);
+	size_t nbones = bone_vector.size();
+	for (SkeletonPose* pose : poses)
+		if (pose->world.size() != nbones)
+			pose->world.assign(nbones, glm::mat4(1.0f));
+
+	const std::vector<uint32_t>& offsets = lod ? lod->level_offsets : level_offsets;
+	const std::vector<uint32_t>& bones = lod ? lod->level_bones : level_bones;
+	int npose = poses.size();
+	for (size_t d = 0; d + 1 < offsets.size(); d++) {
+		const uint32_t* level = bones.data() + offsets[d];
+		int nlevel = offsets[d + 1] - offsets[d];
+		if (nlevel == 0)
+			continue;
+		int n = nlevel * npose;
+#pragma omp parallel for schedule(static) if (n >= kMinParallelBones)
+		for (int k = 0; k < n; k++) {
+			SkeletonPose& pose = *poses[k / nlevel];
+			uint32_t i = level[k % nlevel];
+			glm::mat4 local = local_matrix(pose.rotation[i], pose.translation[i]);
+			pose.world[i] = (bone_parent[i] >= 0) ? pose.world[bone_parent[i]] * local : local;
+		}
+	}
+}
+
+void Skeleton::build_lod(int max_depth, float min_importance, size_t max_bones,
+		SkeletonLOD& lod) const
+{
+	size_t nbones = bone_vector.size();
+	std::vector<float> importance(bone_length.begin(), bone_length.end());
+	for (size_t i = nbones; i-- > 1; )
+		importance[bone_parent[i]] += importance[i];
+	float total = (nbones > 0) ? importance[0] : 0.0f;
+
+	// Importance never grows down the tree, so sorting by it (parents
+	// first on ties) and cutting anywhere keeps whole subtrees out.
+	std::vector<int> order;
+	for (size_t d = 0; d + 1 < level_offsets.size() && int(d) <= max_depth; d++)
+		for (uint32_t k = level_offsets[d]; k < level_offsets[d + 1]; k++) {
+			uint32_t i = level_bones[k];
+			if (i == 0 || importance[i] >= min_importance * total)
+				order.push_back(i);
+		}
+	std::stable_sort(order.begin(), order.end(), [&importance](int l, int r) {
+		return importance[l] > importance[r] || (importance[l] == importance[r] && l < r);
+	});
+
+	lod.active.assign(nbones, false);
+	lod.nactive = 0;
+	for (int i : order) {
+		if (lod.nactive >= std::max<size_t>(max_bones, 1))
+			break;
+		if (bone_parent[i] >= 0 && !lod.active[bone_parent[i]])
+			continue;
+		lod.active[i] = true;
+		lod.nactive++;
+	}
+
+	lod.level_offsets.assign(1, 0);
+	lod.level_bones.clear();
+	for (size_t d = 0; d + 1 < level_offsets.size(); d++) {
+		for (uint32_t k = level_offsets[d]; k < level_offsets[d + 1]; k++)
+			if (lod.active[level_bones[k]])
+				lod.level_bones.push_back(level_bones[k]);
+		lod.level_offsets.push_back(lod.level_bones.size());
+	}
+
+	// Bind frames are rigid, so every joint moving with bone a, tip or
+	// not, has the palette entry world[a] * inverse(bind world[a]).
+	size_t njoints = joint_bone.size();
+	std::vector<int> bone_entry(nbones, -1);
+	for (size_t j = njoints; j-- > 0; )
+		bone_entry[joint_bone[j]] = j;
+	lod.palette_bones.clear();
+	lod.joint_map.resize(njoints);
+	for (size_t j = 0; j < njoints; j++) {
+		int b = joint_bone[j];
+		if (lod.active[b]) {
+			lod.joint_map[j] = j;
+			continue;
+		}
+		while (!lod.active[b])
+			b = bone_parent[b];
+		if (bone_entry[b] < 0) {
+			bone_entry[b] = njoints + lod.palette_bones.size();
+			lod.palette_bones.push_back(b);
+		}
+		lod.joint_map[j] = bone_entry[b];
+	}
 }
 
-void Bone::add_leaves(std::vector<Bone*> leaves)
+/*
+ * Appends the joints whose frames depend on the subtree of the given bone.
+ */
+void Skeleton::subtree_joints(int bone, std::vector<int>& joints)
 {
-	this->leaves.insert(this->leaves.end(), leaves.begin(), leaves.end());
+	if (bone < 0 || bone >= int(bone_vector.size()))
+		return;
+	for (size_t i = 0; i < joint_bone.size(); i++)
+		if (joint_bone[i] >= bone && joint_bone[i] < subtree_end[bone])
+			joints.push_back(i);
 }
 
-glm::mat4 Bone::translate()
+IKStats Skeleton::solve_ik(int bone, glm::vec3 target, int chain_length,
+		int max_iterations, float tolerance, float budget_ms)
 {
-	glm::mat4 ret(1.0f);
-	if (root != nullptr)
-		ret *= root->translate();
-	return ret * transformation;
+	IKStats stats = { 0, 0.0f, 0.0f, false, bone };
+	if (bone <= 0 || bone >= int(bone_vector.size()))
+		return stats;
+	auto start = std::chrono::steady_clock::now();
+	auto elapsed_ms = [&start]() {
+		return std::chrono::duration<float, std::milli>(
+				std::chrono::steady_clock::now() - start).count();
+	};
+
+	std::vector<int> chain;
+	for (int j = bone; j > 0 && int(chain.size()) < chain_length; j = bone_parent[j])
+		chain.push_back(j);
+	if (!chain.empty())
+		stats.top_bone = chain.back();
+
+	update_world();
+	auto tip = [this, bone]() {
+		return glm::vec3(bone_world[bone] * glm::vec4(0.0f, 0.0f, bone_length[bone], 1.0f));
+	};
+	glm::vec3 effector = tip();
+	stats.error = glm::length(target - effector);
+	bool out_of_time = false;
+	while (stats.error > tolerance && stats.iterations < max_iterations &&
+	       !out_of_time) {
+		for (int j : chain) {
+			glm::vec3 pivot(bone_world[j][3]);
+			glm::vec3 from = effector - pivot, to = target - pivot;
+			glm::vec3 axis = glm::cross(from, to);
+			float s = glm::length(axis);
+			if (s >= 1e-8f * glm::length(from) * glm::length(to)) {
+				float angle = std::atan2(s, glm::dot(from, to));
+
+				/*
+				 * Bone::rotate() works in the parent's frame, and a
+				 * left handed frame turns the rotation the other way.
+				 */
+				glm::mat3 parent_r(1.0f);
+				if (bone_parent[j] >= 0)
+					parent_r = glm::mat3(bone_world[bone_parent[j]]);
+				if (glm::determinant(parent_r) < 0.0f)
+					angle = -angle;
+				bone_vector[j].rotate(angle, glm::transpose(parent_r) * (axis / s));
+				update_world();
+				effector = tip();
+			}
+			// Checked per joint so that a long chain cannot overrun.
+			if (elapsed_ms() >= budget_ms) {
+				out_of_time = true;
+				break;
+			}
+		}
+		stats.iterations++;
+		stats.error = glm::length(target - effector);
+	}
+	stats.converged = stats.error <= tolerance;
+	stats.time_ms = elapsed_ms();
+	return stats;
 }
 
-glm::mat4 Bone::transform()
+//#####################################################################//
+
+Bone::Bone(Skeleton* skeleton, int index, Joint* first, Joint* last)
+	: index(index), skeleton(skeleton),
+	first_joint(first), last_joint(last)
 {
-	glm::mat4 ret(1.0f);
-	if (root != nullptr)
-		ret *= root->transform();
-	return ret * transformation * S;
 }
 
-glm::mat4 Bone::rotate()
+glm::mat4 Bone::transform()
 {
-	glm::mat4 ret(1.0f);
-	if (root != nullptr)
-		ret *= root->rotate();
-	return ret * S;
+	skeleton->update_world();
+	return skeleton->bone_world[index];
 }
 
-glm::vec4 Bone::first_w()
+glm::mat4 Bone::rotate()
 {
-	glm::vec3 ret(0.0f, 0.0f, 0.0f);
-	if (root != nullptr)
-		ret += glm::vec3(root->first_w());
-	return glm::vec4(ret + first_joint->offset, 1.0f);
+	return glm::mat4(glm::mat3(transform()));
 }
 
-glm::vec4 Bone::last_w()
+float Bone::get_length()
 {
-	return glm::vec4(glm::vec3(first_w()) + last_joint->offset, 1.0f);
+	return skeleton->bone_length[index];
 }
 
+/*
+ * Rolling about the bone's own t axis is a rotation about z applied on the
+ * right of its rotation; rotating about an axis of the parent frame is one
+ * on the left.
+ */
 void Bone::roll(float theta)
 {
-	glm::mat4 roll_m = glm::rotate(theta, tS);
-	nS = glm::normalize(glm::vec3(roll_m * glm::vec4(nS, 0.0f)));
-	bS = glm::normalize(glm::vec3(roll_m * glm::vec4(bS, 0.0f)));
-
-	S[0] = glm::vec4(bS, 0.0f);
-	S[1] = glm::vec4(nS, 0.0f);
-	S[2] = glm::vec4(tS, 0.0f);
-	S[3] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+	glm::quat& q = skeleton->bone_rotation[index];
+	q = glm::normalize(q * glm::angleAxis(theta, glm::vec3(0.0f, 0.0f, 1.0f)));
+	skeleton->mark_dirty(index);
 }
 
 void Bone::rotate(float rotation_speed_, glm::vec3 worldDrag)
 {
-	glm::mat4 rotate_m = glm::rotate(rotation_speed_, worldDrag);
-	tS = glm::normalize(glm::vec3(rotate_m * glm::vec4(tS, 0.0f)));
-	nS = glm::normalize(glm::vec3(rotate_m * glm::vec4(nS, 0.0f)));
-	bS = glm::normalize(glm::vec3(rotate_m * glm::vec4(bS, 0.0f)));
-
-	S[0] = glm::vec4(bS, 0.0f);
-	S[1] = glm::vec4(nS, 0.0f);
-	S[2] = glm::vec4(tS, 0.0f);
- 	S[3] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+	glm::quat& q = skeleton->bone_rotation[index];
+	q = glm::normalize(glm::angleAxis(rotation_speed_, glm::normalize(worldDrag)) * q);
+	skeleton->mark_dirty(index);
 }
 
 bool Bone::intersect(glm::vec3 s_b, glm::vec3 dir, float y, float& x)
 {
-	glm::mat4 m = transform();
-	glm::mat4 _m = glm::inverse(m);
-	glm::vec3 m_s = glm::vec3(_m * glm::vec4(s_b, 1.0f));
-	glm::vec3 m_dir = glm::vec3(_m * glm::vec4(dir, 0.0f));
+	skeleton->update_world();
+	// The bone frame is rigid, so the inverse rotation is the transpose.
+	const glm::mat4& world = skeleton->bone_world[index];
+	glm::mat3 r_inv = glm::transpose(glm::mat3(world));
+	glm::vec3 m_s = r_inv * (s_b - glm::vec3(world[3]));
+	glm::vec3 m_dir = r_inv * dir;
 
 	float a = pow(m_dir.y, 2) + pow(m_dir.x, 2);
 	float b = 2 * m_s.x * m_dir.x + 2 * m_s.y * m_dir.y;
@@ -241,9 +567,9 @@ bool Bone::intersect(glm::vec3 s_b, glm::vec3 dir, float y, float& x)
 	glm::vec3 point_inter1 = (m_s + m_dir * t1);
 
 	bool v0 = (t0 >= 0 && point_inter0.z >= 0 &&
-			point_inter0.z <= length);
+			point_inter0.z <= get_length());
 	bool v1 = (t1 >= 0 && point_inter1.z >= 0 &&
-			point_inter1.z <= length);
+			point_inter1.z <= get_length());
 
 	if (v0 && v1) x = std::min(t0, t1);
 	else if (v0) x = t0;
@@ -252,22 +578,6 @@ bool Bone::intersect(glm::vec3 s_b, glm::vec3 dir, float y, float& x)
 	return (v0 || v1) ? true : false;
 }
 
-void Bone::_calc_joints(std::vector<glm::vec4>& points, std::vector<glm::uvec2>& lines,
-		glm::mat4 root_trans)
-{
-	glm::vec4 beg = root_trans * transformation * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
-	glm::vec4 end = root_trans * transformation * S * glm::vec4(0.0f, 0.0f, length, 1.0f);
-
-	points.push_back(beg);
-	points.push_back(end);
-	lines.push_back(glm::uvec2(points.size(), points.size() + 1));
-
-	for (auto it = leaves.begin(); it != leaves.end(); it++) {
-		Bone* leaf = *it;
-		leaf->_calc_joints(points, lines, root_trans * transformation * S);
-	}
-}
-
 //#####################################################################//
 
 Joint::Joint(glm::vec3 offset, int pid)
@@ -3,10 +3,12 @@
 
 #include <unordered_map>
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <mmdadapter.h>
 #include <vector>
-
-static size_t bone_id = 0;
+#include <cstdint>
+#include "capsule_bvh.h"
+#include "skinning.h"
 
 class Joint {
 public:
@@ -17,60 +19,207 @@ public:
 	int pid;
 };
 
+class Skeleton;
+
+/*
+ * SkeletonPose: the pose of one instance of a skeleton, e.g. one character
+ * of a crowd, as local rotations and translations in the skeleton's bone
+ * order. Skeleton::get_pose() starts it from the skeleton's own pose; a
+ * rotation r is applied to bone i like Bone::rotate() does, as
+ * rotation[i] = r * rotation[i]. world is filled by evaluate_poses().
+ */
+struct SkeletonPose {
+	std::vector<glm::quat> rotation;
+	std::vector<glm::vec3> translation;
+	std::vector<glm::mat4> world;
+};
+
+/*
+ * SkeletonLOD: a reduced skeleton for characters seen from afar. Inactive
+ * bones are not evaluated, so their world matrices in a SkeletonPose stay
+ * at the last pose (identity if it had none), and they move rigidly with
+ * their nearest active ancestor instead. Inactive bones always form whole
+ * subtrees.
+ *
+ * The palette entry of joint j is replaced by entry joint_map[j]: j itself
+ * if its bone is active, otherwise a joint moving with that ancestor, or
+ * past the joints, entry njoints + k for the frame of palette_bones[k].
+ */
+struct SkeletonLOD {
+	std::vector<bool> active;
+	std::vector<int> joint_map;
+	std::vector<int> palette_bones;
+	size_t nactive = 0;
+	// Active bones by depth, as Skeleton::level_offsets and level_bones.
+	std::vector<uint32_t> level_offsets;
+	std::vector<uint32_t> level_bones;
+};
+
+/*
+ * IKStats: what one Skeleton::solve_ik() call did. top_bone is the bone
+ * nearest the root that may have been rotated, so the pose changed in its
+ * subtree only.
+ */
+struct IKStats {
+	int iterations;
+	float time_ms;
+	float error;
+	bool converged;
+	int top_bone;
+};
+
+/*
+ * Bone: a view of one bone of a Skeleton, which owns the pose data. Bone
+ * ids are per skeleton: the index of the bone in depth first order, as
+ * taken by Skeleton::get_at().
+ */
 class Bone {
 private:
-	int id;
-	Bone* root;
+	int index;
+	Skeleton* skeleton;
 	Joint *first_joint, *last_joint;
-	std::vector<Bone*> leaves;
-
-	float length;
-	glm::vec3 t, n, b;
-	glm::vec3 tS, bS, nS;
-	glm::mat4 transformation, rotation, S;
-
-	glm::vec4 first_w(), last_w();
-	void update();
 
 public:
-	Bone(Joint* first, Joint* last, Bone* head = nullptr);
-	~Bone();
+	Bone(Skeleton* skeleton, int index, Joint* first, Joint* last);
 
-	void add_leaf(Bone* leaf);
-	void add_leaves(std::vector<Bone*> leaves);
-	glm::mat4 translate();
 	glm::mat4 transform();
 	glm::mat4 rotate();
 	void rotate(float rotation_speed_, glm::vec3 worldDrag);
 	void roll(float theta);
 
 	bool intersect(glm::vec3 s_b, glm::vec3 dir, float y, float& x);
-	int getId() { return id; }
-	float get_length() { return this->length; }
-
-	void _calc_joints(std::vector<glm::vec4>& points, std::vector<glm::uvec2>& lines,
-			glm::mat4 root_trans);
+	int getId() { return index; }
+	float get_length();
 };
 
 class Skeleton {
+	friend class Bone;
 private:
+	/*
+	 * Joints and bones are stored by value and never reallocated after
+	 * construction, so Bone and Joint pointers stay valid for the life of
+	 * the skeleton. The children of bone i are the bones j in
+	 * (i, subtree_end[i]) with bone_parent[j] == i.
+	 *
+	 * Every per joint and per bone array below is allocated once, at its
+	 * final capacity, by the constructor, and freed once by the
+	 * destructor; nothing is allocated per Joint or Bone. The arrays are
+	 * separate vectors rather than one arena, so loading a skeleton costs
+	 * one allocation per array, plus the picking BVH on first use.
+	 */
+	std::vector<Joint> joint_vector;
+	std::vector<Bone> bone_vector;
 	Bone* root;
-	std::unordered_map<int, Bone*> bone_map;
-	std::vector<Bone*> bone_vector;
 	std::vector<SparseTuple> weights;
 
+	/*
+	 * Joint j moves with the first bone starting at j, or with the tip of
+	 * the bone ending at j if j is a leaf (joint_tip[j] is true then).
+	 */
+	std::vector<int> joint_bone;
+	std::vector<bool> joint_tip;
+
+	/*
+	 * bone_vector is in depth first order, so the subtree of bone i is
+	 * [i, subtree_end[i]).
+	 */
+	std::vector<int> bone_parent;
+	std::vector<int> subtree_end;
+
+	/*
+	 * The bones at depth d are level_bones[k] for k in
+	 * [level_offsets[d], level_offsets[d + 1]).
+	 */
+	std::vector<uint32_t> level_offsets;
+	std::vector<uint32_t> level_bones;
+
+	/*
+	 * Local pose of bone i, in bone_vector order (parents before children):
+	 *	  bone_world[i] = bone_world[bone_parent[i]] * T_i * R_i
+	 * bone_translation[i] is the start of the bone in its parent's frame.
+	 * The bone frame R_i has the columns b, n, t with t along the bone and
+	 * b = cross(t, n), which is left handed, so bone_rotation[i] holds the
+	 * rotation to the frame (-b, n, t) and b is mirrored back when the
+	 * matrix is built.
+	 */
+	std::vector<glm::vec3> bone_translation;
+	std::vector<glm::quat> bone_rotation;
+	std::vector<glm::mat4> bone_world;
+	std::vector<float> bone_length;
+	std::vector<glm::vec3> bind_start; // Start of each bone in the bind pose.
+
+	/*
+	 * Editing bone i marks its subtree dirty; the cached world matrices
+	 * of dirty bones are recomputed, from dirty_begin on, the next time
+	 * any of them is read.
+	 */
+	std::vector<bool> bone_dirty;
+	size_t dirty_begin = SIZE_MAX;
+	size_t moved_begin = SIZE_MAX, moved_end = 0; // Since update_joints().
+
+	/*
+	 * Bounds of the bones for picking, refit by bone_inter() when the pose
+	 * or the pick radius changed since the last refit.
+	 */
+	CapsuleBVH bone_bvh;
+	float bvh_radius = -1.0f;
+	bool bvh_stale = true;
+
+	void init_bones(int r_n);
+	int add_bone(Joint* first, Joint* last, int parent);
+	void mark_dirty(int bone);
+	void update_world();
+	void refit_bvh(float radius);
+
 public:
 	Skeleton();
-	Skeleton(Bone* root);
 	Skeleton(const std::vector<glm::vec3>& offset, const std::vector<int>& parent, const std::vector<SparseTuple>& weights);
 	~Skeleton();
+	Skeleton(const Skeleton&) = delete; // Bones point back at their skeleton.
+	Skeleton& operator=(const Skeleton&) = delete;
 
 	Bone* get_at(size_t i);
 	size_t get_size() { return bone_vector.size(); }
 	Bone* bone_inter(glm::vec3 b, glm::vec3 dir, float y);
-	std::vector<Bone*> init_bone(std::vector<Joint*> joints, Bone* root_bone, int r_n);
+	Bone* bone_inter(glm::vec3 b, glm::vec3 dir, float y, float& distance);
 	void calc_joints(std::vector<glm::vec4>& points, std::vector<glm::uvec2>& lines);
 	void move_joints(std::vector<glm::vec4>& points);
+	IndexRange update_joints(std::vector<glm::vec4>& points);
+
+	const std::vector<SparseTuple>& get_weights() const { return weights; }
+	size_t get_joint_count() const { return joint_bone.size(); }
+	void calc_transforms(std::vector<glm::mat4>& world);
+	void joint_frames(std::vector<glm::mat4>& frames);
+	void joint_frames(const std::vector<glm::mat4>& world,
+			std::vector<glm::mat4>& frames) const;
+	void get_pose(SkeletonPose& pose);
+	/*
+	 * World matrices of many poses at once, one depth level at a time:
+	 * the bones of a level across all poses only depend on the level
+	 * above, so each level is one parallel loop. With a lod, only its
+	 * active bones are evaluated.
+	 */
+	void evaluate_poses(const std::vector<SkeletonPose*>& poses,
+			const SkeletonLOD* lod = nullptr) const;
+	/*
+	 * Keeps the bones at most max_depth below the root whose subtrees
+	 * hold at least min_importance of the total bone length, and at most
+	 * max_bones of them, the most important first. Short chains such as
+	 * fingers, hair strands and accessories go first.
+	 */
+	void build_lod(int max_depth, float min_importance, size_t max_bones,
+			SkeletonLOD& lod) const;
+	void subtree_joints(int bone, std::vector<int>& joints);
+	/*
+	 * Cyclic coordinate descent: rotates the given bone and up to
+	 * chain_length - 1 of its ancestors (never the root) in turn to move
+	 * the tip of the bone towards target. Stops once the tip is within
+	 * tolerance, after max_iterations sweeps of the chain, or once
+	 * budget_ms milliseconds have passed, which is checked after every
+	 * joint. A sweep cut short still counts as an iteration.
+	 */
+	IKStats solve_ik(int bone, glm::vec3 target, int chain_length,
+			int max_iterations, float tolerance, float budget_ms);
 
 };
 
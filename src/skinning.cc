@@ -0,0 +1,412 @@
+#include "skinning.h"
+#include "skinning_kernels.h"
+#include "skeletal_sys.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+	const SkinningKernelInfo& kernel()
+	{
+		static const SkinningKernelInfo info = select_skinning_kernel();
+		return info;
+	}
+
+	// Top 3 rows of each palette matrix, then an identity entry.
+	void palette_to_rows(const std::vector<glm::mat4>& palette,
+			std::vector<float>& rows)
+	{
+		rows.assign((palette.size() + 1) * 12, 0.0f);
+		for (size_t i = 0; i < palette.size(); i++)
+			for (int r = 0; r < 3; r++)
+				for (int c = 0; c < 4; c++)
+					rows[i * 12 + r * 4 + c] = palette[i][c][r];
+		for (int r = 0; r < 3; r++)
+			rows[palette.size() * 12 + r * 4 + r] = 1.0f;
+	}
+}
+
+void InfluenceTable::build(const std::vector<SparseTuple>& tuples,
+		size_t nvertices, size_t njoints)
+{
+	this->njoints = njoints;
+	auto valid = [nvertices, njoints](const SparseTuple& tup) {
+		return tup.vid >= 0 && size_t(tup.vid) < nvertices &&
+		       tup.jid >= 0 && size_t(tup.jid) < njoints;
+	};
+	// Counting sort by vertex id, which keeps the order of influences
+	// within each vertex.
+	offsets.assign(nvertices + 1, 0);
+	for (const auto& tup : tuples)
+		if (valid(tup))
+			offsets[tup.vid + 1]++;
+	for (size_t v = 0; v < nvertices; v++)
+		offsets[v + 1] += offsets[v];
+
+	joints.resize(offsets[nvertices]);
+	weights.resize(offsets[nvertices]);
+	std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+	for (const auto& tup : tuples) {
+		if (!valid(tup))
+			continue;
+		uint32_t i = cursor[tup.vid]++;
+		joints[i] = tup.jid;
+		weights[i] = tup.weight;
+	}
+	buildInverse();
+}
+
+void InfluenceTable::buildInverse()
+{
+	size_t nvertices = getNumberOfVertices();
+	joint_offsets.assign(njoints + 1, 0);
+	for (auto j : joints)
+		joint_offsets[j + 1]++;
+	for (size_t j = 0; j < njoints; j++)
+		joint_offsets[j + 1] += joint_offsets[j];
+
+	joint_vertices.resize(joints.size());
+	std::vector<uint32_t> cursor(joint_offsets.begin(), joint_offsets.end() - 1);
+	for (size_t v = 0; v < nvertices; v++)
+		for (uint32_t i = offsets[v]; i < offsets[v + 1]; i++)
+			joint_vertices[cursor[joints[i]]++] = v;
+}
+
+float InfluenceTable::prune(int max_influences, float epsilon,
+		const std::vector<glm::vec4>& vertices,
+		const std::vector<glm::vec3>& pivots,
+		const std::vector<int>& parents)
+{
+	// Hop count and bone length from each joint up to the root.
+	size_t npivots = std::min(pivots.size(), parents.size());
+	std::vector<int> depth(npivots, 0);
+	std::vector<float> reach(npivots, 0.0f);
+	for (size_t j = 0; j < npivots; j++)
+		for (int i = j; parents[i] >= 0 && size_t(parents[i]) < npivots; i = parents[i]) {
+			depth[j]++;
+			reach[j] += glm::length(pivots[i] - pivots[parents[i]]);
+		}
+	auto path_length = [&](int a, int b) {
+		int lca_a = a, lca_b = b;
+		while (depth[lca_a] > depth[lca_b]) lca_a = parents[lca_a];
+		while (depth[lca_b] > depth[lca_a]) lca_b = parents[lca_b];
+		while (lca_a != lca_b) lca_a = parents[lca_a], lca_b = parents[lca_b];
+		return reach[a] + reach[b] - 2.0f * reach[lca_a];
+	};
+
+	size_t nvertices = getNumberOfVertices();
+	std::vector<uint32_t> order;
+	std::vector<uint16_t> kept_joints;
+	std::vector<float> kept_weights;
+	float max_error = 0.0f;
+	uint32_t out = 0;
+	for (size_t v = 0; v < nvertices; v++) {
+		uint32_t beg = offsets[v], end = offsets[v + 1];
+		offsets[v] = out;
+		order.clear();
+		for (uint32_t i = beg; i < end; i++)
+			order.push_back(i);
+		std::stable_sort(order.begin(), order.end(),
+			[this](uint32_t a, uint32_t b) { return weights[a] > weights[b]; });
+
+		// Weights are sorted, so the kept influences are a prefix.
+		float total = 0.0f, kept = 0.0f;
+		size_t nkept = 0;
+		for (size_t k = 0; k < order.size(); k++) {
+			float w = weights[order[k]];
+			total += w;
+			if (k == 0 || (int(k) < max_influences && w >= epsilon)) {
+				kept += w;
+				nkept++;
+			}
+		}
+
+		float error = 0.0f;
+		if (v < vertices.size() && kept > 0.0f) {
+			glm::vec3 pos = glm::vec3(vertices[v]);
+			for (size_t d = nkept; d < order.size(); d++) {
+				size_t jd = joints[order[d]];
+				if (jd >= npivots)
+					continue;
+				float arm = glm::length(pos - pivots[jd]);
+				for (size_t k = 0; k < nkept; k++) {
+					size_t jk = joints[order[k]];
+					if (jk >= npivots)
+						continue;
+					float spread = arm + glm::length(pos - pivots[jk]) + path_length(jd, jk);
+					error += weights[order[d]] / total * weights[order[k]] / kept * spread;
+				}
+			}
+		}
+		max_error = std::max(max_error, error);
+
+		// Compacted in place; out never passes beg.
+		kept_joints.clear();
+		kept_weights.clear();
+		for (size_t k = 0; k < nkept; k++) {
+			kept_joints.push_back(joints[order[k]]);
+			kept_weights.push_back(kept > 0.0f ? weights[order[k]] / kept : 0.0f);
+		}
+		for (size_t k = 0; k < nkept; k++, out++) {
+			joints[out] = kept_joints[k];
+			weights[out] = kept_weights[k];
+		}
+	}
+	if (nvertices > 0)
+		offsets[nvertices] = out;
+	joints.resize(out);
+	weights.resize(out);
+	buildInverse();
+	return max_error;
+}
+
+void InfluenceTable::merge(const std::vector<int>& joint_map, size_t njoints)
+{
+	this->njoints = njoints;
+	size_t nvertices = getNumberOfVertices();
+	uint32_t out = 0;
+	for (size_t v = 0; v < nvertices; v++) {
+		uint32_t beg = offsets[v], end = offsets[v + 1];
+		offsets[v] = out;
+		uint32_t first = out;
+		// Compacted in place; out never passes i.
+		for (uint32_t i = beg; i < end; i++) {
+			uint16_t j = (joints[i] < joint_map.size()) ? joint_map[joints[i]] : joints[i];
+			uint32_t k = first;
+			while (k < out && joints[k] != j)
+				k++;
+			if (k < out) {
+				weights[k] += weights[i];
+			} else {
+				joints[out] = j;
+				weights[out++] = weights[i];
+			}
+		}
+	}
+	offsets[nvertices] = out;
+	joints.resize(out);
+	weights.resize(out);
+	buildInverse();
+}
+
+size_t InfluenceTable::getByteSize() const
+{
+	return offsets.size() * sizeof(uint32_t) +
+	       joints.size() * sizeof(uint16_t) +
+	       weights.size() * sizeof(float);
+}
+
+void SkinningStream::build(const InfluenceTable& influences,
+		const std::vector<glm::vec4>& vertices,
+		const std::vector<glm::vec4>& normals)
+{
+	nvertices = vertices.size();
+	size_t nblocks = (nvertices + kSkinLanes - 1) / kSkinLanes;
+	size_t padded = nblocks * kSkinLanes;
+	px.assign(padded, 0.0f), py.assign(padded, 0.0f), pz.assign(padded, 0.0f);
+	nx.assign(padded, 0.0f), ny.assign(padded, 0.0f), nz.assign(padded, 0.0f);
+	for (size_t v = 0; v < nvertices; v++) {
+		px[v] = vertices[v].x, py[v] = vertices[v].y, pz[v] = vertices[v].z;
+		if (v < normals.size())
+			nx[v] = normals[v].x, ny[v] = normals[v].y, nz[v] = normals[v].z;
+	}
+
+	const int32_t identity = influences.njoints * 12;
+	block_slots.assign(nblocks + 1, 0);
+	block_runs.clear();
+	slot_joints.clear();
+	slot_weights.clear();
+	for (size_t b = 0; b < nblocks; b++) {
+		size_t vbeg = b * kSkinLanes;
+		size_t vend = std::min<size_t>(vbeg + kSkinLanes, nvertices);
+		uint32_t nslots = 1;
+		for (size_t v = vbeg; v < vend; v++)
+			nslots = std::max(nslots, influences.offsets[v + 1] - influences.offsets[v]);
+		if (nslots == 3)
+			nslots = 4; // No specialised kernel for 3 slots.
+		block_slots[b + 1] = block_slots[b] + nslots;
+		if (b == 0 || nslots != block_slots[b] - block_slots[b - 1])
+			block_runs.push_back({ b, b + 1 });
+		else
+			block_runs.back().end = b + 1;
+
+		for (uint32_t k = 0; k < nslots; k++) {
+			for (size_t v = vbeg; v < vbeg + kSkinLanes; v++) {
+				uint32_t beg = 0, end = 0;
+				if (v < vend)
+					beg = influences.offsets[v], end = influences.offsets[v + 1];
+				if (beg + k < end) {
+					slot_joints.push_back(influences.joints[beg + k] * 12);
+					slot_weights.push_back(influences.weights[beg + k]);
+				} else {
+					// Padding, or the identity for unweighted vertices.
+					slot_joints.push_back(identity);
+					slot_weights.push_back((k == 0 && beg == end) ? 1.0f : 0.0f);
+				}
+			}
+		}
+	}
+}
+
+void SkinningTasks::split(const SkinningStream& stream,
+		const std::vector<IndexRange>& blocks)
+{
+	segments.clear();
+	task_offsets.assign(1, 0);
+	size_t filled = 0;
+	for (const auto& range : blocks) {
+		auto run = std::upper_bound(stream.block_runs.begin(), stream.block_runs.end(), range.begin,
+				[](size_t b, const IndexRange& r) { return b < r.end; });
+		for (size_t b = range.begin; b < range.end; b = segments.back().end) {
+			size_t end = std::min({ range.end, run->end, b + kBlocksPerTask - filled });
+			segments.push_back({ b, end });
+			filled += end - b;
+			if (filled == size_t(kBlocksPerTask)) {
+				task_offsets.push_back(segments.size());
+				filled = 0;
+			}
+			if (end == run->end)
+				run++;
+		}
+	}
+	if (filled > 0)
+		task_offsets.push_back(segments.size());
+}
+
+SkinningEngine::SkinningEngine() {}
+
+void SkinningEngine::bind(Skeleton* skeleton)
+{
+	skeleton->joint_frames(inverse_bind_);
+	for (auto& m : inverse_bind_)
+		m = glm::inverse(m);
+	skeleton->calc_transforms(bone_inverse_bind_);
+	for (auto& m : bone_inverse_bind_)
+		m = glm::inverse(m);
+	palette_.assign(inverse_bind_.size(), glm::mat4(1.0f));
+	palette_to_rows(palette_, palette_rows_);
+}
+
+void SkinningEngine::updatePalette(Skeleton* skeleton)
+{
+	computePalette(skeleton, palette_);
+	palette_to_rows(palette_, palette_rows_);
+}
+
+void SkinningEngine::updatePalette(Skeleton* skeleton, const std::vector<int>& joints,
+		const std::vector<float>& reach, float tolerance,
+		std::vector<int>& changed)
+{
+	std::vector<glm::mat4> palette;
+	computePalette(skeleton, palette);
+	changed.clear();
+	for (int j : joints) {
+		if (j < 0 || size_t(j) >= palette.size())
+			continue;
+		glm::mat4 delta = palette[j] - palette_[j];
+		float rotation = 0.0f;
+		for (int c = 0; c < 3; c++)
+			rotation += glm::dot(glm::vec3(delta[c]), glm::vec3(delta[c]));
+		float moved = std::sqrt(rotation) * (size_t(j) < reach.size() ? reach[j] : 0.0f) +
+			glm::length(glm::vec3(delta[3]));
+		if (moved <= tolerance)
+			continue;
+		palette_[j] = palette[j];
+		for (int r = 0; r < 3; r++)
+			for (int c = 0; c < 4; c++)
+				palette_rows_[j * 12 + r * 4 + c] = palette[j][c][r];
+		changed.push_back(j);
+	}
+}
+
+void SkinningEngine::computePalette(Skeleton* skeleton,
+		std::vector<glm::mat4>& palette) const
+{
+	skeleton->joint_frames(palette);
+	palette.resize(inverse_bind_.size());
+	for (size_t i = 0; i < palette.size(); i++)
+		palette[i] = palette[i] * inverse_bind_[i];
+}
+
+void SkinningEngine::computePalette(Skeleton* skeleton, const std::vector<glm::mat4>& world,
+		std::vector<glm::mat4>& palette, const SkeletonLOD* lod) const
+{
+	skeleton->joint_frames(world, palette);
+	palette.resize(inverse_bind_.size());
+	for (size_t i = 0; i < palette.size(); i++)
+		palette[i] = palette[i] * inverse_bind_[i];
+	if (lod)
+		for (int b : lod->palette_bones)
+			palette.push_back(world[b] * bone_inverse_bind_[b]);
+}
+
+void SkinningEngine::skin(const SkinningStream& stream,
+		std::vector<glm::vec3>& animated,
+		std::vector<uint32_t>* normals) const
+{
+	animated.resize(stream.nvertices);
+	if (normals)
+		normals->resize(stream.nvertices);
+	skin(stream, { { 0, stream.getNumberOfBlocks() } }, animated, normals);
+}
+
+void SkinningEngine::skin(const SkinningStream& stream,
+		const std::vector<IndexRange>& blocks,
+		std::vector<glm::vec3>& animated,
+		std::vector<uint32_t>* normals) const
+{
+	skin(stream, blocks, animated.data(), normals ? normals->data() : nullptr);
+}
+
+void SkinningEngine::skin(const SkinningStream& stream,
+		const std::vector<IndexRange>& blocks,
+		glm::vec3* positions, uint32_t* normals) const
+{
+	SkinningTasks tasks;
+	tasks.split(stream, blocks);
+
+	const SkinningKernelInfo& info = kernel();
+	int ntasks = tasks.getNumberOfTasks();
+#pragma omp parallel for schedule(static)
+	for (int t = 0; t < ntasks; t++)
+		for (uint32_t s = tasks.task_offsets[t]; s < tasks.task_offsets[t + 1]; s++) {
+			const IndexRange& segment = tasks.segments[s];
+			size_t b = segment.begin;
+			uint32_t width = stream.block_slots[b + 1] - stream.block_slots[b];
+			info.run[skinning_kernel_slot(width)](stream, palette_rows_.data(),
+					b, segment.end, positions, normals);
+		}
+}
+
+void SkinningEngine::skinInstances(const SkinningStream& stream,
+		const std::vector<const std::vector<glm::mat4>*>& palettes,
+		const std::vector<SkinningTarget>& targets) const
+{
+	size_t ninstances = std::min(palettes.size(), targets.size());
+	std::vector<std::vector<float>> rows(ninstances);
+	for (size_t i = 0; i < ninstances; i++)
+		palette_to_rows(*palettes[i], rows[i]);
+
+	SkinningTasks tasks;
+	tasks.split(stream, { { 0, stream.getNumberOfBlocks() } });
+
+	// Tile major: every instance is skinned from a segment while its bind
+	// pose data is still in cache.
+	const SkinningKernelInfo& info = kernel();
+	int ntasks = tasks.getNumberOfTasks();
+#pragma omp parallel for schedule(static)
+	for (int t = 0; t < ntasks; t++)
+		for (uint32_t s = tasks.task_offsets[t]; s < tasks.task_offsets[t + 1]; s++) {
+			const IndexRange& segment = tasks.segments[s];
+			size_t b = segment.begin;
+			uint32_t width = stream.block_slots[b + 1] - stream.block_slots[b];
+			SkinningKernel run = info.run[skinning_kernel_slot(width)];
+			for (size_t i = 0; i < ninstances; i++)
+				run(stream, rows[i].data(), b, segment.end,
+						targets[i].positions, targets[i].normals);
+		}
+}
+
+const char* SkinningEngine::getKernelName()
+{
+	return kernel().name;
+}
@@ -0,0 +1,252 @@
+#ifndef SKINNING_H
+#define SKINNING_H
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <glm/glm.hpp>
+#include <mmdadapter.h>
+
+class Skeleton;
+struct SkeletonLOD;
+
+/*
+ * InfluenceTable: joint weights in compressed sparse row form.
+ *
+ * The influences of vertex v are joints[i] and weights[i] for i in
+ * [offsets[v], offsets[v + 1]). The table is built once from the
+ * SparseTuple list so that skinning streams through it without searching.
+ *
+ * The inverse index lists the vertices influenced by joint j, in ascending
+ * order, as joint_vertices[i] for i in [joint_offsets[j], joint_offsets[j + 1]).
+ */
+struct InfluenceTable {
+	std::vector<uint32_t> offsets;
+	std::vector<uint16_t> joints;
+	std::vector<float> weights;
+	size_t njoints = 0;
+
+	std::vector<uint32_t> joint_offsets;
+	std::vector<uint32_t> joint_vertices;
+
+	void build(const std::vector<SparseTuple>& tuples, size_t nvertices,
+			size_t njoints);
+	void buildInverse();
+	/*
+	 * Keeps the max_influences heaviest influences of every vertex,
+	 * drops those weighted below epsilon (but never the heaviest), and
+	 * normalises the rest to add up to one, as Mesh::updateBounds()
+	 * assumes. Every kept weight is thus at least epsilon.
+	 *
+	 * Returns the largest position error this can cause in any pose,
+	 * against the original weights normalised the same way. The error of
+	 * a vertex is sum_d w_d * |blend_kept(v) - P_d v| over the dropped
+	 * joints d, and since bones keep their lengths,
+	 *	  |P_k v - P_d v| <= |v - pivot_k| + |v - pivot_d| + path(k, d)
+	 * where pivots are the bind positions of the joints, parents their
+	 * parent joints, and path(k, d) the bone length between them.
+	 */
+	float prune(int max_influences, float epsilon,
+			const std::vector<glm::vec4>& vertices,
+			const std::vector<glm::vec3>& pivots,
+			const std::vector<int>& parents);
+	/*
+	 * Moves the influences of every joint j to joint_map[j], adding up the
+	 * weights of influences that end on the same joint. The merged table
+	 * has njoints joints, which may be more than before.
+	 */
+	void merge(const std::vector<int>& joint_map, size_t njoints);
+	size_t getNumberOfVertices() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+	size_t getNumberOfInfluences() const { return joints.size(); }
+	size_t getByteSize() const; // Forward table only.
+};
+
+/*
+ * IndexRange: the half-open range [begin, end) of vertices or blocks.
+ */
+struct IndexRange {
+	size_t begin, end;
+};
+
+/*
+ * Skinned normals are stored as GL_INT_2_10_10_10_REV: x, y and z as
+ * 10 bit signed normalised values from the low bits up, and w = 0.
+ */
+inline uint32_t pack_normal(const glm::vec3& n)
+{
+	auto snorm = [](float f) { return uint32_t(int32_t(lrintf(f * 511.0f))) & 0x3ff; };
+	return snorm(n.x) | (snorm(n.y) << 10) | (snorm(n.z) << 20);
+}
+
+inline glm::vec3 unpack_normal(uint32_t p)
+{
+	auto snorm = [](uint32_t bits) {
+		return std::max(float(int32_t(bits << 22) >> 22) / 511.0f, -1.0f);
+	};
+	return glm::vec3(snorm(p), snorm(p >> 10), snorm(p >> 20));
+}
+
+/*
+ * Number of vertices handled together by the skinning kernels.
+ */
+const int kSkinLanes = 8;
+
+/*
+ * Blocks per work item handed to a thread.
+ */
+const int kBlocksPerTask = 64;
+
+/*
+ * SkinningStream: bind pose data staged for the vectorised kernels.
+ *
+ * Vertices are grouped in blocks of kSkinLanes. Positions and normals are
+ * stored in SoA order (padded to whole blocks). Block b owns the influence
+ * slots [block_slots[b], block_slots[b + 1]); each slot holds one
+ * influence for each of the kSkinLanes vertices, zero weighted for vertices
+ * with fewer influences than the widest vertex of the block.
+ *
+ * slot_joints stores offsets into the 3x4 palette rows (joint * 12), and
+ * vertices without any influence point at the identity entry placed after
+ * the last joint.
+ *
+ * Blocks have 1, 2, 4 or more slots (3 is padded to 4), and block_runs
+ * splits them into maximal runs of equal width, so that each run can be
+ * handed to a kernel specialised for its width.
+ */
+struct SkinningStream {
+	size_t nvertices = 0;
+	std::vector<float> px, py, pz;
+	std::vector<float> nx, ny, nz;
+	std::vector<uint32_t> block_slots;
+	std::vector<IndexRange> block_runs;
+	std::vector<int32_t> slot_joints;
+	std::vector<float> slot_weights;
+
+	void build(const InfluenceTable& influences,
+			const std::vector<glm::vec4>& vertices,
+			const std::vector<glm::vec4>& normals);
+	size_t getNumberOfBlocks() const { return block_slots.empty() ? 0 : block_slots.size() - 1; }
+};
+
+/*
+ * SkinningTasks: the work items of a skinning pass over some blocks of a
+ * stream. Segments are pieces of the block ranges of a single width, cut
+ * at the block_runs boundaries. Task t runs the segments
+ * [task_offsets[t], task_offsets[t + 1]), which together hold
+ * kBlocksPerTask blocks (fewer only in the last task), so that short runs
+ * of mixed widths share tasks instead of making one each.
+ */
+struct SkinningTasks {
+	std::vector<IndexRange> segments;
+	std::vector<uint32_t> task_offsets;
+
+	void split(const SkinningStream& stream, const std::vector<IndexRange>& blocks);
+	size_t getNumberOfTasks() const { return task_offsets.empty() ? 0 : task_offsets.size() - 1; }
+};
+
+/*
+ * SkinningTarget: output arrays of one skinned copy of a stream, each of at
+ * least stream.nvertices elements. normals may be null.
+ */
+struct SkinningTarget {
+	glm::vec3* positions;
+	uint32_t* normals;
+};
+
+/*
+ * VertexSink: destination of Mesh::skinInto(), such as the mapped vertex
+ * buffers of a render pass. map() opens the vertices in range for
+ * writing and returns arrays indexed by vertex id, of which only the
+ * entries in range may be touched; their old contents may be discarded.
+ * unmap() closes them again and returns false if the contents were lost
+ * and have to be written again in full.
+ */
+struct VertexSink {
+	std::function<bool(const IndexRange& range,
+			glm::vec3*& positions, uint32_t*& normals)> map;
+	std::function<bool()> unmap;
+};
+
+/*
+ * SkinningEngine: linear blend skinning on the CPU.
+ *
+ * Every vertex is deformed by the joints it is weighted to:
+ *	  v' = sum_j w_j * F_j * inverse(B_j) * v
+ * where B_j is the frame of joint j in the bind pose (captured by bind())
+ * and F_j is its frame in the current pose (updatePalette()). The products
+ * F_j * inverse(B_j) form the skinning palette.
+ *
+ * skin() runs the widest kernel the CPU supports (AVX2, SSE4.1 or plain
+ * C++, picked once from CPUID) over a SkinningStream, splits the blocks
+ * across the OpenMP threads, and scatters the results into the compact
+ * vertex layout: float3 positions and pack_normal() normals.
+ */
+class SkinningEngine {
+public:
+	SkinningEngine();
+
+	void bind(Skeleton* skeleton);
+	void updatePalette(Skeleton* skeleton);
+	/*
+	 * The palette of the given pose of a skeleton shaped like the bound
+	 * one, without touching the engine's own palette.
+	 */
+	void computePalette(Skeleton* skeleton, std::vector<glm::mat4>& palette) const;
+	/*
+	 * Same, for a pose of the skeleton given by its world matrices (see
+	 * Skeleton::evaluate_poses()). With a lod, the entries of its
+	 * palette_bones follow those of the joints.
+	 */
+	void computePalette(Skeleton* skeleton, const std::vector<glm::mat4>& world,
+			std::vector<glm::mat4>& palette,
+			const SkeletonLOD* lod = nullptr) const;
+	/*
+	 * Update only those palette entries of the given joints that changed
+	 * by more than tolerance since they were last set, and list them in
+	 * changed. reach[j] bounds |v| over the bind pose vertices weighted
+	 * to joint j, so a change (dR, dt) of entry j moves them by at most
+	 * |dR|_F * reach[j] + |dt|.
+	 */
+	void updatePalette(Skeleton* skeleton, const std::vector<int>& joints,
+			const std::vector<float>& reach, float tolerance,
+			std::vector<int>& changed);
+	void skin(const SkinningStream& stream,
+			std::vector<glm::vec3>& animated,
+			std::vector<uint32_t>* normals = nullptr) const;
+	/*
+	 * Re-skin only the given block ranges. The output buffers must
+	 * already hold a complete skinned mesh.
+	 */
+	void skin(const SkinningStream& stream,
+			const std::vector<IndexRange>& blocks,
+			std::vector<glm::vec3>& animated,
+			std::vector<uint32_t>* normals = nullptr) const;
+	/*
+	 * Same as above, writing into caller owned arrays of at least
+	 * stream.nvertices elements, e.g. mapped vertex buffers.
+	 */
+	void skin(const SkinningStream& stream,
+			const std::vector<IndexRange>& blocks,
+			glm::vec3* positions, uint32_t* normals = nullptr) const;
+	/*
+	 * Skin the whole stream once per instance, instance i with
+	 * palettes[i] (as from computePalette()) into targets[i]. The stream
+	 * is walked once, in tiles, and every instance is skinned from a
+	 * tile before moving to the next.
+	 */
+	void skinInstances(const SkinningStream& stream,
+			const std::vector<const std::vector<glm::mat4>*>& palettes,
+			const std::vector<SkinningTarget>& targets) const;
+
+	const std::vector<glm::mat4>& getPalette() const { return palette_; }
+	static const char* getKernelName();
+private:
+	std::vector<glm::mat4> inverse_bind_;
+	std::vector<glm::mat4> bone_inverse_bind_; // Of the bone frames.
+	std::vector<glm::mat4> palette_;
+	std::vector<float> palette_rows_; // Top 3 rows of each palette matrix.
+};
+
+#endif
@@ -0,0 +1,273 @@
+#include "skinning_kernels.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <iostream>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SKINNING_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * All kernels share the same structure: for each block, blend the 3x4
+ * palette rows of every influence slot into 12 per-lane accumulators, then
+ * transform the SoA position and normal of each lane with the blended
+ * matrix. Normals only use the rotation part, and are renormalised since
+ * blending rotations shrinks them, then packed with pack_normal().
+ *
+ * Each kernel is instantiated for blocks of exactly N slots (N = 1, 2, 4),
+ * where the slot loop has a constant trip count and is fully unrolled, and
+ * with N = 0 for blocks of any width.
+ */
+
+namespace {
+
+// Squared length below which a normal is left unnormalised (e.g. padding).
+const float kMinNormal2 = 1e-20f;
+
+template<int N>
+void skin_scalar(const SkinningStream& stream, const float* palette,
+		size_t block_begin, size_t block_end,
+		glm::vec3* positions, uint32_t* normals)
+{
+	for (size_t b = block_begin; b < block_end; b++) {
+		float m[12][kSkinLanes] = {};
+		uint32_t first = stream.block_slots[b];
+		uint32_t nslots = N ? N : stream.block_slots[b + 1] - first;
+		for (uint32_t s = first; s < first + nslots; s++) {
+			const int32_t* j = &stream.slot_joints[s * kSkinLanes];
+			const float* w = &stream.slot_weights[s * kSkinLanes];
+			for (int e = 0; e < 12; e++)
+				for (int l = 0; l < kSkinLanes; l++)
+					m[e][l] += w[l] * palette[j[l] + e];
+		}
+		size_t base = b * kSkinLanes;
+		int nlanes = std::min<size_t>(kSkinLanes, stream.nvertices - base);
+		for (int l = 0; l < nlanes; l++) {
+			size_t v = base + l;
+			float x = stream.px[v], y = stream.py[v], z = stream.pz[v];
+			positions[v] = glm::vec3(
+					m[0][l] * x + m[1][l] * y + m[2][l] * z + m[3][l],
+					m[4][l] * x + m[5][l] * y + m[6][l] * z + m[7][l],
+					m[8][l] * x + m[9][l] * y + m[10][l] * z + m[11][l]);
+			if (!normals)
+				continue;
+			x = stream.nx[v], y = stream.ny[v], z = stream.nz[v];
+			glm::vec3 n(m[0][l] * x + m[1][l] * y + m[2][l] * z,
+					m[4][l] * x + m[5][l] * y + m[6][l] * z,
+					m[8][l] * x + m[9][l] * y + m[10][l] * z);
+			n /= std::sqrt(std::max(glm::dot(n, n), kMinNormal2));
+			normals[v] = pack_normal(n);
+		}
+	}
+}
+
+#ifdef SKINNING_X86
+
+/*
+ * SSE4.1: the block is processed as two halves of 4 lanes. There is no
+ * gather instruction, the palette entries are inserted lane by lane.
+ */
+template<int N>
+__attribute__((target("sse4.1")))
+void skin_sse41(const SkinningStream& stream, const float* palette,
+		size_t block_begin, size_t block_end,
+		glm::vec3* positions, uint32_t* normals)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 snorm = _mm_set1_ps(511.0f);
+	const __m128i mask = _mm_set1_epi32(0x3ff);
+	for (size_t b = block_begin; b < block_end; b++) {
+		size_t base = b * kSkinLanes;
+		uint32_t first = stream.block_slots[b];
+		uint32_t nslots = N ? N : stream.block_slots[b + 1] - first;
+		for (int h = 0; h < kSkinLanes; h += 4) {
+			if (base + h >= stream.nvertices)
+				break;
+			__m128 m[12];
+			for (int e = 0; e < 12; e++)
+				m[e] = zero;
+			for (uint32_t s = first; s < first + nslots; s++) {
+				const int32_t* j = &stream.slot_joints[s * kSkinLanes + h];
+				__m128 w = _mm_loadu_ps(&stream.slot_weights[s * kSkinLanes + h]);
+				const float *p0 = palette + j[0], *p1 = palette + j[1],
+				      *p2 = palette + j[2], *p3 = palette + j[3];
+				for (int e = 0; e < 12; e++) {
+					__m128 g = _mm_set_ps(p3[e], p2[e], p1[e], p0[e]);
+					m[e] = _mm_add_ps(m[e], _mm_mul_ps(w, g));
+				}
+			}
+			size_t v = base + h;
+			int nlanes = std::min<size_t>(4, stream.nvertices - v);
+			__m128 x = _mm_loadu_ps(&stream.px[v]);
+			__m128 y = _mm_loadu_ps(&stream.py[v]);
+			__m128 z = _mm_loadu_ps(&stream.pz[v]);
+			__m128 ox = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0], x), _mm_mul_ps(m[1], y)),
+					_mm_add_ps(_mm_mul_ps(m[2], z), m[3]));
+			__m128 oy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[4], x), _mm_mul_ps(m[5], y)),
+					_mm_add_ps(_mm_mul_ps(m[6], z), m[7]));
+			__m128 oz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[8], x), _mm_mul_ps(m[9], y)),
+					_mm_add_ps(_mm_mul_ps(m[10], z), m[11]));
+			alignas(16) float tx[4], ty[4], tz[4];
+			_mm_store_ps(tx, ox), _mm_store_ps(ty, oy), _mm_store_ps(tz, oz);
+			for (int l = 0; l < nlanes; l++)
+				positions[v + l] = glm::vec3(tx[l], ty[l], tz[l]);
+			if (!normals)
+				continue;
+			x = _mm_loadu_ps(&stream.nx[v]);
+			y = _mm_loadu_ps(&stream.ny[v]);
+			z = _mm_loadu_ps(&stream.nz[v]);
+			ox = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0], x), _mm_mul_ps(m[1], y)), _mm_mul_ps(m[2], z));
+			oy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[4], x), _mm_mul_ps(m[5], y)), _mm_mul_ps(m[6], z));
+			oz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[8], x), _mm_mul_ps(m[9], y)), _mm_mul_ps(m[10], z));
+			__m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)), _mm_mul_ps(oz, oz));
+			__m128 scale = _mm_div_ps(snorm, _mm_sqrt_ps(_mm_max_ps(len2, _mm_set1_ps(kMinNormal2))));
+			__m128i ix = _mm_and_si128(_mm_cvtps_epi32(_mm_mul_ps(ox, scale)), mask);
+			__m128i iy = _mm_and_si128(_mm_cvtps_epi32(_mm_mul_ps(oy, scale)), mask);
+			__m128i iz = _mm_and_si128(_mm_cvtps_epi32(_mm_mul_ps(oz, scale)), mask);
+			__m128i packed = _mm_or_si128(ix, _mm_or_si128(_mm_slli_epi32(iy, 10), _mm_slli_epi32(iz, 20)));
+			if (nlanes == 4) {
+				_mm_storeu_si128((__m128i*)&normals[v], packed);
+			} else {
+				alignas(16) uint32_t tmp[4];
+				_mm_store_si128((__m128i*)tmp, packed);
+				std::copy(tmp, tmp + nlanes, &normals[v]);
+			}
+		}
+	}
+}
+
+/*
+ * Interleave 8 lanes of x, y, z into 8 consecutive vec3s. Each 128 bit
+ * half is shuffled into x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3.
+ */
+__attribute__((target("avx2,fma")))
+inline void store_vec3x8(__m256 x, __m256 y, __m256 z, glm::vec3* out, int nlanes)
+{
+	__m256 xy = _mm256_unpacklo_ps(x, y), xy_hi = _mm256_unpackhi_ps(x, y);
+	__m256 yz = _mm256_unpacklo_ps(y, z), yz_hi = _mm256_unpackhi_ps(y, z);
+	__m256 zx = _mm256_unpacklo_ps(z, x), zx_hi = _mm256_unpackhi_ps(z, x);
+	__m256 r0 = _mm256_shuffle_ps(xy, zx, _MM_SHUFFLE(3, 0, 1, 0));
+	__m256 r1 = _mm256_shuffle_ps(yz, xy_hi, _MM_SHUFFLE(1, 0, 3, 2));
+	__m256 r2 = _mm256_shuffle_ps(zx_hi, yz_hi, _MM_SHUFFLE(3, 2, 3, 0));
+	__m256 r[3] = {
+		_mm256_permute2f128_ps(r0, r1, 0x20),
+		_mm256_permute2f128_ps(r2, r0, 0x30),
+		_mm256_permute2f128_ps(r1, r2, 0x31),
+	};
+	float* dst = &out[0][0];
+	if (nlanes == kSkinLanes) {
+		for (int i = 0; i < 3; i++)
+			_mm256_storeu_ps(dst + i * 8, r[i]);
+		return;
+	}
+	alignas(32) float tmp[24];
+	for (int i = 0; i < 3; i++)
+		_mm256_store_ps(tmp + i * 8, r[i]);
+	std::copy(tmp, tmp + nlanes * 3, dst);
+}
+
+/*
+ * AVX2: one block per iteration, palette entries fetched with gathers and
+ * blended with FMA.
+ */
+template<int N>
+__attribute__((target("avx2,fma")))
+void skin_avx2(const SkinningStream& stream, const float* palette,
+		size_t block_begin, size_t block_end,
+		glm::vec3* positions, uint32_t* normals)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 snorm = _mm256_set1_ps(511.0f);
+	const __m256i mask = _mm256_set1_epi32(0x3ff);
+	for (size_t b = block_begin; b < block_end; b++) {
+		__m256 m[12];
+		for (int e = 0; e < 12; e++)
+			m[e] = zero;
+		uint32_t first = stream.block_slots[b];
+		uint32_t nslots = N ? N : stream.block_slots[b + 1] - first;
+		for (uint32_t s = first; s < first + nslots; s++) {
+			__m256i j = _mm256_loadu_si256((const __m256i*)&stream.slot_joints[s * kSkinLanes]);
+			__m256 w = _mm256_loadu_ps(&stream.slot_weights[s * kSkinLanes]);
+			for (int e = 0; e < 12; e++)
+				m[e] = _mm256_fmadd_ps(w, _mm256_i32gather_ps(palette + e, j, 4), m[e]);
+		}
+		size_t v = b * kSkinLanes;
+		int nlanes = std::min<size_t>(kSkinLanes, stream.nvertices - v);
+		__m256 x = _mm256_loadu_ps(&stream.px[v]);
+		__m256 y = _mm256_loadu_ps(&stream.py[v]);
+		__m256 z = _mm256_loadu_ps(&stream.pz[v]);
+		__m256 ox = _mm256_fmadd_ps(m[0], x, _mm256_fmadd_ps(m[1], y, _mm256_fmadd_ps(m[2], z, m[3])));
+		__m256 oy = _mm256_fmadd_ps(m[4], x, _mm256_fmadd_ps(m[5], y, _mm256_fmadd_ps(m[6], z, m[7])));
+		__m256 oz = _mm256_fmadd_ps(m[8], x, _mm256_fmadd_ps(m[9], y, _mm256_fmadd_ps(m[10], z, m[11])));
+		store_vec3x8(ox, oy, oz, positions + v, nlanes);
+		if (!normals)
+			continue;
+		x = _mm256_loadu_ps(&stream.nx[v]);
+		y = _mm256_loadu_ps(&stream.ny[v]);
+		z = _mm256_loadu_ps(&stream.nz[v]);
+		ox = _mm256_fmadd_ps(m[0], x, _mm256_fmadd_ps(m[1], y, _mm256_mul_ps(m[2], z)));
+		oy = _mm256_fmadd_ps(m[4], x, _mm256_fmadd_ps(m[5], y, _mm256_mul_ps(m[6], z)));
+		oz = _mm256_fmadd_ps(m[8], x, _mm256_fmadd_ps(m[9], y, _mm256_mul_ps(m[10], z)));
+		__m256 len2 = _mm256_fmadd_ps(ox, ox, _mm256_fmadd_ps(oy, oy, _mm256_mul_ps(oz, oz)));
+		__m256 scale = _mm256_div_ps(snorm, _mm256_sqrt_ps(_mm256_max_ps(len2, _mm256_set1_ps(kMinNormal2))));
+		__m256i ix = _mm256_and_si256(_mm256_cvtps_epi32(_mm256_mul_ps(ox, scale)), mask);
+		__m256i iy = _mm256_and_si256(_mm256_cvtps_epi32(_mm256_mul_ps(oy, scale)), mask);
+		__m256i iz = _mm256_and_si256(_mm256_cvtps_epi32(_mm256_mul_ps(oz, scale)), mask);
+		__m256i packed = _mm256_or_si256(ix,
+				_mm256_or_si256(_mm256_slli_epi32(iy, 10), _mm256_slli_epi32(iz, 20)));
+		if (nlanes == kSkinLanes) {
+			_mm256_storeu_si256((__m256i*)&normals[v], packed);
+		} else {
+			alignas(32) uint32_t tmp[kSkinLanes];
+			_mm256_store_si256((__m256i*)tmp, packed);
+			std::copy(tmp, tmp + nlanes, &normals[v]);
+		}
+	}
+}
+
+#endif
+
+}
+
+std::vector<SkinningKernelInfo> supported_skinning_kernels()
+{
+	std::vector<SkinningKernelInfo> kernels;
+#ifdef SKINNING_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		kernels.push_back({ "avx2", { skin_avx2<1>, skin_avx2<2>, skin_avx2<4>, skin_avx2<0> } });
+	if (__builtin_cpu_supports("sse4.1"))
+		kernels.push_back({ "sse4.1", { skin_sse41<1>, skin_sse41<2>, skin_sse41<4>, skin_sse41<0> } });
+#endif
+	kernels.push_back({ "scalar", { skin_scalar<1>, skin_scalar<2>, skin_scalar<4>, skin_scalar<0> } });
+	return kernels;
+}
+
+SkinningKernelInfo select_skinning_kernel()
+{
+	// SKINNING_KERNEL=avx2|sse4.1|scalar caps the selection, for
+	// comparisons. Kernels are ranked from the widest down.
+	static const char* const names[] = { "avx2", "sse4.1", "scalar" };
+	const int nnames = sizeof(names) / sizeof(names[0]);
+	auto rank = [&](const std::string& name) {
+		return std::find(names, names + nnames, name) - names;
+	};
+
+	std::vector<SkinningKernelInfo> kernels = supported_skinning_kernels();
+	const char* cap = getenv("SKINNING_KERNEL");
+	if (!cap || !*cap)
+		return kernels.front();
+	int limit = rank(cap);
+	if (limit == nnames) {
+		std::cerr << "Unknown SKINNING_KERNEL \"" << cap
+			<< "\", expected avx2, sse4.1 or scalar.\n";
+		return kernels.front();
+	}
+	for (const auto& kernel : kernels)
+		if (rank(kernel.name) >= limit)
+			return kernel;
+	return kernels.back();
+}
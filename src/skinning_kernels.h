@@ -0,0 +1,48 @@
+#ifndef SKINNING_KERNELS_H
+#define SKINNING_KERNELS_H
+
+#include "skinning.h"
+
+/*
+ * A skinning kernel deforms blocks [block_begin, block_end) of a stream
+ * with the given palette rows (12 floats per joint, identity last), and
+ * writes positions and, if not null, unit normals packed by pack_normal().
+ */
+typedef void (*SkinningKernel)(const SkinningStream& stream,
+		const float* palette_rows,
+		size_t block_begin, size_t block_end,
+		glm::vec3* positions, uint32_t* normals);
+
+/*
+ * run[skinning_kernel_slot(width)] handles blocks of the given number of
+ * influence slots; the last entry accepts blocks of any width.
+ */
+struct SkinningKernelInfo {
+	const char* name;
+	SkinningKernel run[4];
+};
+
+inline int skinning_kernel_slot(uint32_t width)
+{
+	switch (width) {
+		case 1: return 0;
+		case 2: return 1;
+		case 4: return 2;
+		default: return 3;
+	}
+}
+
+/*
+ * Every kernel the running CPU supports, the widest first.
+ */
+std::vector<SkinningKernelInfo> supported_skinning_kernels();
+
+/*
+ * Picks the widest kernel supported by the running CPU, unless capped by
+ * the SKINNING_KERNEL environment variable (avx2, sse4.1 or scalar) to
+ * the widest supported one at or below it. Unknown values are reported
+ * on stderr and ignored.
+ */
+SkinningKernelInfo select_skinning_kernel();
+
+#endif
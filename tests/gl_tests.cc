@@ -0,0 +1,168 @@
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include "bone_geometry.h"
+#include "render_pass.h"
+#include <iostream>
+#include <string>
+
+/*
+ * Checks of the mapped vertex buffer path of RenderPass on an offscreen
+ * EGL context, for the models given on the command line. Exits with 77,
+ * which ctest reports as skipped, when no OpenGL 3.3 context can be
+ * created, and otherwise with the number of failed checks.
+ */
+
+namespace {
+
+const int kSkipped = 77;
+
+int failures = 0;
+
+void check(bool ok, const std::string& model, const std::string& what)
+{
+	std::cout << (ok ? "PASS " : "FAIL ") << model << ": " << what << "\n";
+	if (!ok)
+		failures++;
+}
+
+const char* vertex_shader =
+"#version 330 core\n"
+"in vec4 vertex_position;\n"
+"in vec4 normal;\n"
+"out vec4 vs_normal;\n"
+"void main() { gl_Position = vertex_position; vs_normal = normal; }\n";
+
+const char* fragment_shader =
+"#version 330 core\n"
+"in vec4 vs_normal;\n"
+"out vec4 fragment_color;\n"
+"void main() { fragment_color = vs_normal; }\n";
+
+/*
+ * Makes a core profile context current on a small pbuffer, of the
+ * default display or else of Mesa's surfaceless platform. Nothing is
+ * drawn.
+ */
+bool create_context()
+{
+	EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	EGLint major, minor;
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+		display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+				EGL_DEFAULT_DISPLAY, nullptr);
+		if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+			return false;
+#else
+		return false;
+#endif
+	}
+	const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint nconfigs = 0;
+	if (!eglChooseConfig(display, config_attribs, &config, 1, &nconfigs) || nconfigs < 1)
+		return false;
+	if (!eglBindAPI(EGL_OPENGL_API))
+		return false;
+	const EGLint context_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+	if (context == EGL_NO_CONTEXT)
+		return false;
+	const EGLint pbuffer_attribs[] = { EGL_WIDTH, 16, EGL_HEIGHT, 16, EGL_NONE };
+	EGLSurface surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+	if (!eglMakeCurrent(display, surface, surface, context))
+		return false;
+
+	glewExperimental = GL_TRUE;
+	// Without an X display GLEW may report a GLX error after it has
+	// loaded the core entry points, which is all we need.
+	glewInit();
+	glGetError();
+	return glMapBufferRange != nullptr && glGetBufferSubData != nullptr;
+}
+
+/*
+ * Contents of the vertex buffer behind an attribute of a pass.
+ */
+template<typename T>
+std::vector<T> read_attribute(const RenderPass& pass, int position, size_t nelements)
+{
+	GLint buffer = 0;
+	glBindVertexArray(pass.getVAO());
+	glGetVertexAttribiv(position, GL_VERTEX_ATTRIB_ARRAY_BUFFER_BINDING, &buffer);
+	std::vector<T> data(nelements);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glGetBufferSubData(GL_ARRAY_BUFFER, 0, nelements * sizeof(T), data.data());
+	return data;
+}
+
+/*
+ * Mesh::skinInto() through the range mapped buffers of a RenderPass must
+ * leave them equal to the CPU output of the same poses, after a full
+ * write and after partial ones that keep the rest of the buffers.
+ */
+void test_mapped_buffers(const std::string& model)
+{
+	Mesh mesh, reference;
+	mesh.loadpmd(model);
+	reference.loadpmd(model);
+	mesh.pose_tolerance = reference.pose_tolerance = 0.0f;
+	size_t nvertices = mesh.vertices.size();
+
+	RenderDataInput input;
+	input.assign(0, "vertex_position", nullptr, nvertices, 3, GL_FLOAT);
+	input.assign(1, "normal", nullptr, nvertices, 4, GL_INT_2_10_10_10_REV, true);
+	input.assign_index(mesh.faces.data(), mesh.faces.size(), 3);
+	RenderPass pass(-1, input, { vertex_shader, nullptr, fragment_shader },
+			{}, { "fragment_color" });
+	VertexSink sink = pass.vertexSink();
+
+	std::vector<IndexRange> dirty;
+	bool ok = mesh.skinInto(sink, true, {}, dirty);
+	reference.updateAnimation();
+	ok = ok && read_attribute<glm::vec3>(pass, 0, nvertices) == reference.animated_vertices &&
+		read_attribute<uint32_t>(pass, 1, nvertices) == reference.animated_normals;
+	check(ok, model, "skinInto fills mapped buffers with the skinned vertices");
+
+	size_t written = 0;
+	int nbones = mesh.getNumberOfBones();
+	for (int b = 1; b < nbones && ok; b += 7) {
+		mesh.skeleton->get_at(b)->rotate(0.3f, glm::vec3(0.0f, 0.0f, 1.0f));
+		reference.skeleton->get_at(b)->rotate(0.3f, glm::vec3(0.0f, 0.0f, 1.0f));
+		ok = mesh.skinInto(sink, false, { b }, dirty);
+		for (const auto& range : dirty)
+			written += range.end - range.begin;
+		reference.updateAnimation({ b }, dirty);
+		ok = ok && read_attribute<glm::vec3>(pass, 0, nvertices) == reference.animated_vertices &&
+			read_attribute<uint32_t>(pass, 1, nvertices) == reference.animated_normals;
+	}
+	check(ok && written < nvertices * ((nbones + 5) / 7), model,
+			"partial skinInto through mapped ranges keeps the buffers current");
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <PMD file>..." << std::endl;
+		return -1;
+	}
+	if (!create_context()) {
+		std::cout << "SKIP no offscreen OpenGL 3.3 context\n";
+		return kSkipped;
+	}
+	for (int i = 1; i < argc; i++)
+		test_mapped_buffers(argv[i]);
+	return failures;
+}
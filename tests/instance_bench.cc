@@ -0,0 +1,82 @@
+#include "bone_geometry.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+/*
+ * Times a crowd of instances of one model: evaluating their poses and
+ * palettes together, skinning them in one batched pass, and, for
+ * comparison, skinning them one by one through the single mesh path.
+ * The first two are timed again with every instance on the mesh's LOD.
+ *
+ * Usage: instance_bench <PMD file> [instances] [repetitions]
+ */
+
+namespace {
+
+template<typename F>
+double time_ms(int repetitions, F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < repetitions; r++)
+		f();
+	std::chrono::duration<double, std::milli> elapsed =
+		std::chrono::steady_clock::now() - start;
+	return elapsed.count() / repetitions;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <PMD file> [instances] [repetitions]" << std::endl;
+		return -1;
+	}
+	int ninstances = argc > 2 ? std::atoi(argv[2]) : 64;
+	int repetitions = argc > 3 ? std::atoi(argv[3]) : 20;
+	Mesh mesh;
+	mesh.verbose = true;
+	mesh.loadpmd(argv[1]);
+
+	std::vector<MeshInstance> instances(ninstances);
+	for (int i = 0; i < ninstances; i++) {
+		for (int b = 1; b < mesh.getNumberOfBones(); b += 3 + i % 4)
+			mesh.skeleton->get_at(b)->rotate(0.05f, glm::vec3(0.0f, 1.0f, 0.0f));
+		mesh.skeleton->get_pose(instances[i].pose);
+	}
+	mesh.updateInstancePalettes(instances);
+	mesh.updateInstances(instances);
+
+	double palettes = time_ms(repetitions, [&]() {
+		mesh.updateInstancePalettes(instances);
+	});
+	double batched = time_ms(repetitions, [&]() {
+		mesh.updateInstances(instances);
+	});
+	double single = time_ms(repetitions, [&]() {
+		for (auto& instance : instances)
+			mesh.skinning.skin(mesh.skinning_stream,
+					instance.animated_vertices,
+					&instance.animated_normals);
+	});
+	for (auto& instance : instances)
+		instance.lod = &mesh.lod;
+	mesh.updateInstancePalettes(instances);
+	double lod_palettes = time_ms(repetitions, [&]() {
+		mesh.updateInstancePalettes(instances);
+	});
+	double lod_batched = time_ms(repetitions, [&]() {
+		mesh.updateInstances(instances);
+	});
+
+	std::cout << ninstances << " instances of " << mesh.vertices.size()
+		<< " vertices, " << mesh.getNumberOfBones() << " bones, "
+		<< SkinningEngine::getKernelName() << " kernel\n"
+		<< "  poses and palettes: " << palettes << " ms\n"
+		<< "  batched skinning:   " << batched << " ms\n"
+		<< "  one by one:         " << single << " ms\n"
+		<< "  LOD of " << mesh.lod.skeleton.nactive << " bones, poses and palettes: "
+		<< lod_palettes << " ms, batched skinning: " << lod_batched << " ms\n";
+	return 0;
+}
@@ -0,0 +1,1031 @@
+#include "bone_geometry.h"
+#include "mesh_optimizer.h"
+#include "skinning_kernels.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtx/transform.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <tuple>
+
+/*
+ * Checks of the CPU skinning pipeline against its reference paths, run on
+ * the models given on the command line. Every check prints one line and
+ * the exit status is the number of failed checks.
+ */
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& model, const std::string& what)
+{
+	std::cout << (ok ? "PASS " : "FAIL ") << model << ": " << what << "\n";
+	if (!ok)
+		failures++;
+}
+
+/*
+ * Stands in for mapped vertex buffers: each map() hands out a scratch copy
+ * filled with garbage, as if the range was invalidated, and unmap() copies
+ * the range back. Writes outside the range are thus lost and unwritten
+ * entries inside it show up as garbage.
+ */
+struct ScratchBuffers {
+	std::vector<glm::vec3> positions, scratch_positions;
+	std::vector<uint32_t> normals, scratch_normals;
+	IndexRange mapped;
+
+	VertexSink sink()
+	{
+		VertexSink sink;
+		sink.map = [this](const IndexRange& range,
+				glm::vec3*& p, uint32_t*& n) {
+			scratch_positions.assign(positions.size(), glm::vec3(1e30f));
+			scratch_normals.assign(normals.size(), ~0u);
+			mapped = range;
+			p = scratch_positions.data();
+			n = scratch_normals.data();
+			return true;
+		};
+		sink.unmap = [this]() {
+			std::copy(scratch_positions.begin() + mapped.begin,
+					scratch_positions.begin() + mapped.end,
+					positions.begin() + mapped.begin);
+			std::copy(scratch_normals.begin() + mapped.begin,
+					scratch_normals.begin() + mapped.end,
+					normals.begin() + mapped.begin);
+			return true;
+		};
+		return sink;
+	}
+};
+
+/*
+ * Mesh::skinInto() through range mapped buffers must leave them equal to
+ * a full skin of the same pose, both for edits of given bones and when
+ * the moved joints are found by the mesh.
+ */
+void test_skin_into(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	mesh.pose_tolerance = 0.0f;
+	size_t nvertices = mesh.vertices.size();
+	ScratchBuffers buffers;
+	buffers.positions.resize(nvertices);
+	buffers.normals.resize(nvertices);
+	VertexSink sink = buffers.sink();
+	std::vector<IndexRange> dirty;
+	bool ok = mesh.skinInto(sink, true, {}, dirty);
+
+	size_t written = 0;
+	int nbones = mesh.getNumberOfBones();
+	for (int b = 1; b < nbones && ok; b += 7) {
+		mesh.skeleton->get_at(b)->rotate(0.3f, glm::vec3(0.0f, 0.0f, 1.0f));
+		std::vector<int> bones;
+		if (b % 2)
+			bones.push_back(b);
+		ok = mesh.skinInto(sink, false, bones, dirty);
+		for (const auto& range : dirty)
+			written += range.end - range.begin;
+
+		mesh.updateAnimation();
+		ok = ok && buffers.positions == mesh.animated_vertices &&
+		     buffers.normals == mesh.animated_normals;
+	}
+	check(ok, model, "skinInto with range mapping matches full skinning");
+	check(written < nvertices * ((nbones + 5) / 7), model,
+			"skinInto maps only the moved vertices");
+}
+
+/*
+ * Poses a fresh copy of the skeleton differently for each instance, as
+ * the reference, and expects the batched instance path to reproduce the
+ * single mesh output exactly.
+ */
+void test_instances(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	const int ninstances = 5;
+	std::vector<MeshInstance> instances(ninstances);
+	std::vector<std::vector<glm::vec3>> positions(ninstances);
+	std::vector<std::vector<uint32_t>> normals(ninstances);
+	for (int i = 0; i < ninstances; i++) {
+		for (int b = 1; b < mesh.getNumberOfBones(); b += 3 + i)
+			mesh.skeleton->get_at(b)->rotate(0.2f * (i + 1),
+					glm::normalize(glm::vec3(0.0f, 1.0f, float(i))));
+		mesh.skeleton->get_pose(instances[i].pose);
+		mesh.updateAnimation();
+		positions[i] = mesh.animated_vertices;
+		normals[i] = mesh.animated_normals;
+	}
+	mesh.updateInstancePalettes(instances);
+	mesh.updateInstances(instances);
+
+	bool ok = true;
+	for (int i = 0; i < ninstances; i++)
+		ok = ok && instances[i].animated_vertices == positions[i] &&
+		     instances[i].animated_normals == normals[i];
+	check(ok, model, "instances from get_pose match animated_vertices");
+}
+
+/*
+ * A pose where a few bones move a lot and the rest drift slowly, updated
+ * partially frame after frame: joints whose drift stays within
+ * pose_tolerance are skipped, but no vertex may end up further than the
+ * tolerance from where full skinning puts it.
+ */
+void test_pose_tolerance(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	mesh.pose_tolerance = 1e-2f;
+	mesh.updateAnimation();
+	size_t nvertices = mesh.vertices.size();
+	std::vector<IndexRange> dirty;
+	const int nframes = 40;
+	size_t skinned = 0;
+	float error = 0.0f;
+	for (int f = 0; f < nframes; f++) {
+		for (int b = 1; b < mesh.getNumberOfBones(); b++)
+			mesh.skeleton->get_at(b)->rotate(b % 10 ? 2e-4f : 0.05f,
+					glm::normalize(glm::vec3(0.0f, 1.0f, 1.0f)));
+		mesh.updateAnimation({}, dirty);
+		for (const auto& range : dirty)
+			skinned += range.end - range.begin;
+
+		SkinningEngine exact = mesh.skinning;
+		std::vector<glm::vec3> positions;
+		exact.updatePalette(mesh.skeleton);
+		exact.skin(mesh.skinning_stream, positions);
+		for (size_t v = 0; v < nvertices; v++)
+			error = std::max(error,
+					glm::length(positions[v] - mesh.animated_vertices[v]));
+	}
+	// Rounding of the two palettes adds a little on top of the bound.
+	check(error <= mesh.pose_tolerance * 1.01f, model,
+			"partial skinning stays within pose_tolerance (error " +
+			std::to_string(error) + ")");
+	check(skinned < nvertices * nframes, model,
+			"pose_tolerance skips joints that barely moved");
+}
+
+/*
+ * With recompute_normals, a partial update rewrites only the normals
+ * around the moved vertices. After a few such frames they must match
+ * recomputing every face from the same positions.
+ */
+void test_incremental_normals(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	mesh.recompute_normals = true;
+	mesh.pose_tolerance = 0.0f;
+	mesh.updateAnimation();
+	std::vector<IndexRange> dirty;
+	size_t rewritten = 0;
+	for (int f = 0; f < 3; f++) {
+		for (int b = 1 + f; b < mesh.getNumberOfBones(); b += 7)
+			mesh.skeleton->get_at(b)->rotate(0.2f,
+					glm::normalize(glm::vec3(1.0f, 0.0f, 1.0f)));
+		mesh.updateAnimation({}, dirty);
+		for (const auto& range : dirty)
+			rewritten += range.end - range.begin;
+	}
+	std::vector<glm::vec3> positions = mesh.animated_vertices;
+	std::vector<uint32_t> normals = mesh.animated_normals;
+
+	mesh.face_normals.clear(); // The next call recomputes every face.
+	mesh.updateAnimation();
+	size_t moved = 0, differ = 0;
+	for (size_t v = 0; v < mesh.vertices.size(); v++) {
+		moved += positions[v] != mesh.animated_vertices[v];
+		glm::vec3 d = glm::abs(unpack_normal(normals[v]) -
+				unpack_normal(mesh.animated_normals[v]));
+		differ += std::max(d.x, std::max(d.y, d.z)) > 1.5f / 511.0f;
+	}
+	check(moved == 0 && differ == 0 && rewritten < 3 * mesh.vertices.size(),
+			model, "incremental normals match a full recompute (" +
+			std::to_string(differ) + " differ, " + std::to_string(rewritten) +
+			" rewritten)");
+}
+
+/*
+ * The posed bounds derived from the joint boxes must contain every
+ * skinned vertex, however far the bones are rotated. This holds because
+ * each vertex lies within the moved boxes of the joints it is weighted
+ * to, which is checked vertex by vertex as well.
+ */
+void test_bounds(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	const InfluenceTable& influences = mesh.influences;
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+	size_t outside = 0, outside_joints = 0;
+	for (int pose = 0; pose < 4; pose++) {
+		for (int b = 1; b < mesh.getNumberOfBones(); b++)
+			mesh.skeleton->get_at(b)->rotate(uniform(rng), glm::normalize(
+					glm::vec3(uniform(rng), uniform(rng), uniform(rng))));
+		mesh.updateAnimation();
+		glm::vec3 slack(1e-5f * glm::length(mesh.bounds.max - mesh.bounds.min));
+		glm::vec3 lo = mesh.bounds.min - slack, hi = mesh.bounds.max + slack;
+		for (const auto& p : mesh.animated_vertices)
+			outside += glm::min(glm::max(p, lo), hi) != p;
+
+		const auto& palette = mesh.skinning.getPalette();
+		std::vector<BoundingBox> moved(mesh.joint_bounds);
+		for (size_t j = 0; j < palette.size(); j++) {
+			BoundingBox& box = moved[j];
+			if (box.min.x > box.max.x)
+				continue;
+			glm::vec3 center = 0.5f * (box.min + box.max);
+			glm::vec3 extent = 0.5f * (box.max - box.min);
+			glm::mat3 rot = glm::mat3(palette[j]);
+			center = glm::vec3(palette[j] * glm::vec4(center, 1.0f));
+			extent = glm::abs(rot[0]) * extent.x + glm::abs(rot[1]) * extent.y +
+				glm::abs(rot[2]) * extent.z;
+			box.min = center - extent, box.max = center + extent;
+		}
+		for (size_t v = 0; v < mesh.vertices.size(); v++) {
+			glm::vec3 vlo(std::numeric_limits<float>::max()), vhi(-vlo);
+			for (uint32_t i = influences.offsets[v]; i < influences.offsets[v + 1]; i++)
+				if (influences.weights[i] > 0.0f) {
+					vlo = glm::min(vlo, moved[influences.joints[i]].min);
+					vhi = glm::max(vhi, moved[influences.joints[i]].max);
+				}
+			if (vlo.x > vhi.x)
+				vlo = moved.back().min, vhi = moved.back().max;
+			const glm::vec3& p = mesh.animated_vertices[v];
+			outside_joints += glm::min(glm::max(p, vlo - slack), vhi + slack) != p;
+		}
+	}
+	check(outside == 0, model, "posed bounds contain every skinned vertex (" +
+			std::to_string(outside) + " outside)");
+	check(outside_joints == 0, model,
+			"skinned vertices stay within the moved boxes of their joints (" +
+			std::to_string(outside_joints) + " outside)");
+}
+
+/*
+ * Triangle with its corners rotated so the smallest index is first,
+ * which keeps the winding.
+ */
+glm::uvec3 canonical_face(const glm::uvec3& f)
+{
+	int k = f[1] < f[0] ? (f[2] < f[1] ? 2 : 1) : (f[2] < f[0] ? 2 : 0);
+	return glm::uvec3(f[k], f[(k + 1) % 3], f[(k + 2) % 3]);
+}
+
+/*
+ * The load time mesh optimisations on the raw model: the vertex cache
+ * order must permute the triangles within each material, renumbering the
+ * vertices must leave every triangle with the same corners, and the
+ * cache miss ratio must not get worse.
+ */
+void test_mesh_optimizer(const std::string& model)
+{
+	MMDReader mr;
+	mr.open(model);
+	std::vector<glm::vec4> vertices, normals;
+	std::vector<glm::uvec3> faces;
+	std::vector<glm::vec2> uv;
+	std::vector<Material> materials;
+	mr.getMesh(vertices, faces, normals, uv);
+	mr.getMaterial(materials);
+	size_t nvertices = vertices.size();
+	std::vector<FaceRange> ranges;
+	for (const auto& material : materials)
+		ranges.emplace_back(material.offset, material.offset + material.nfaces);
+
+	std::vector<glm::uvec3> optimized = faces;
+	optimize_vertex_cache(optimized, ranges, nvertices);
+	auto less = [](const glm::uvec3& a, const glm::uvec3& b) {
+		return std::make_tuple(a[0], a[1], a[2]) < std::make_tuple(b[0], b[1], b[2]);
+	};
+	bool permuted = optimized.size() == faces.size();
+	for (const auto& range : ranges) {
+		std::vector<glm::uvec3> before, after;
+		for (size_t f = range.first; f < range.second && permuted; f++) {
+			before.push_back(canonical_face(faces[f]));
+			after.push_back(canonical_face(optimized[f]));
+		}
+		std::sort(before.begin(), before.end(), less);
+		std::sort(after.begin(), after.end(), less);
+		permuted = permuted && before == after;
+	}
+	check(permuted, model, "optimize_vertex_cache permutes the faces of each material");
+
+	std::vector<glm::uvec3> renumbered = optimized;
+	std::vector<uint32_t> remap;
+	reorder_vertices_by_first_use(renumbered, nvertices, remap);
+	std::vector<glm::vec4> new_vertices = vertices, new_normals = normals;
+	std::vector<glm::vec2> new_uv = uv;
+	remap_vertex_array(new_vertices, remap);
+	remap_vertex_array(new_normals, remap);
+	remap_vertex_array(new_uv, remap);
+	std::vector<bool> taken(nvertices, false);
+	bool same = remap.size() == nvertices;
+	for (size_t v = 0; v < remap.size() && same; v++) {
+		same = remap[v] < nvertices && !taken[remap[v]];
+		taken[remap[v]] = same;
+	}
+	for (size_t f = 0; f < renumbered.size() && same; f++)
+		for (int k = 0; k < 3; k++) {
+			uint32_t a = optimized[f][k], b = renumbered[f][k];
+			same = same && vertices[a] == new_vertices[b] &&
+				normals[a] == new_normals[b] && uv[a] == new_uv[b];
+		}
+	check(same, model, "renumbering vertices by first use keeps every triangle");
+
+	float before = average_cache_miss_ratio(faces, nvertices);
+	float after = average_cache_miss_ratio(renumbered, nvertices);
+	check(after <= before, model, "vertex cache miss ratio does not get worse (" +
+			std::to_string(before) + " -> " + std::to_string(after) + ")");
+}
+
+/*
+ * Pruning a made up table of up to six influences per vertex on the
+ * skeleton of the model: rows must end up within the budget, with no
+ * weight under epsilon and adding up to one, and skinning with them
+ * must stay within the returned error in random poses.
+ */
+void test_prune(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	MMDReader mr;
+	mr.open(model);
+	std::vector<int> parents;
+	glm::vec3 offset;
+	int pid;
+	for (int i = 0; mr.getJoint(i, offset, pid); i++)
+		parents.push_back(pid);
+	std::vector<glm::mat4> frames;
+	mesh.skeleton->joint_frames(frames);
+	std::vector<glm::vec3> pivots;
+	for (const auto& frame : frames)
+		pivots.push_back(glm::vec3(frame[3]));
+
+	size_t nvertices = mesh.vertices.size(), njoints = frames.size();
+	std::mt19937 rng(9);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::vector<SparseTuple> tuples;
+	for (size_t v = 0; v < nvertices; v++) {
+		int count = std::uniform_int_distribution<int>(1, 6)(rng);
+		size_t first = tuples.size();
+		float total = 0.0f;
+		for (int k = 0; k < count; k++) {
+			float w = unit(rng);
+			tuples.emplace_back(std::uniform_int_distribution<int>(0, njoints - 1)(rng),
+					v, w * w * w + 1e-4f);
+			total += tuples.back().weight;
+		}
+		for (size_t i = first; i < tuples.size(); i++)
+			tuples[i].weight /= total;
+	}
+	InfluenceTable original;
+	original.build(tuples, nvertices, njoints);
+	InfluenceTable pruned = original;
+	const int max_influences = 2;
+	const float epsilon = 0.05f;
+	float bound = pruned.prune(max_influences, epsilon, mesh.vertices, pivots, parents);
+
+	bool budget = true, heavy = true, normalised = true;
+	for (size_t v = 0; v < nvertices; v++) {
+		uint32_t beg = pruned.offsets[v], end = pruned.offsets[v + 1];
+		budget = budget && end - beg >= 1 && end - beg <= uint32_t(max_influences);
+		float total = 0.0f;
+		for (uint32_t i = beg; i < end; i++) {
+			heavy = heavy && pruned.weights[i] >= epsilon;
+			total += pruned.weights[i];
+		}
+		normalised = normalised && std::abs(total - 1.0f) <= 1e-5f;
+	}
+	check(budget && heavy && normalised, model, "prune keeps at most " +
+			std::to_string(max_influences) + " influences of at least " +
+			std::to_string(epsilon) + " per vertex, adding up to one");
+
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+	float error = 0.0f;
+	for (int pose = 0; pose < 4; pose++) {
+		for (int b = 1; b < mesh.getNumberOfBones(); b++)
+			mesh.skeleton->get_at(b)->rotate(uniform(rng), glm::normalize(
+					glm::vec3(uniform(rng), uniform(rng), uniform(rng))));
+		mesh.updateAnimation();
+		const auto& palette = mesh.skinning.getPalette();
+		auto blend = [&](const InfluenceTable& table, size_t v) {
+			glm::vec3 p(0.0f);
+			for (uint32_t i = table.offsets[v]; i < table.offsets[v + 1]; i++)
+				p += table.weights[i] * glm::vec3(palette[table.joints[i]] * mesh.vertices[v]);
+			return p;
+		};
+		for (size_t v = 0; v < nvertices; v++)
+			error = std::max(error, glm::length(blend(original, v) - blend(pruned, v)));
+	}
+	float extent = glm::length(glm::vec3(mesh.bounds.max - mesh.bounds.min));
+	check(bound > 0.0f && error <= bound + 1e-5f * extent, model,
+			"pruned skinning stays within the prune error bound (error " +
+			std::to_string(error) + ", bound " + std::to_string(bound) + ")");
+}
+
+/*
+ * The model streams change width often, in runs of a few blocks. Tasks
+ * must still hold kBlocksPerTask blocks each (but the last), as segments
+ * of a single width that cover the blocks in order, both for a full pass
+ * and for scattered ranges.
+ */
+void test_tasks(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	const SkinningStream& stream = mesh.skinning_stream;
+	size_t nblocks = stream.getNumberOfBlocks();
+	auto width = [&stream](size_t b) { return stream.block_slots[b + 1] - stream.block_slots[b]; };
+	std::vector<IndexRange> scattered;
+	for (size_t b = 0; b < nblocks; b += 11)
+		scattered.push_back({ b, std::min(nblocks, b + 1 + b % 7) });
+
+	for (const auto& blocks : { std::vector<IndexRange>(1, { 0, nblocks }), scattered }) {
+		SkinningTasks tasks;
+		tasks.split(stream, blocks);
+		std::vector<size_t> wanted, covered;
+		size_t total = 0;
+		for (const auto& range : blocks)
+			for (size_t b = range.begin; b < range.end; b++, total++)
+				wanted.push_back(b);
+		bool uniform = true, full = true;
+		size_t ntasks = tasks.getNumberOfTasks();
+		for (size_t t = 0; t < ntasks; t++) {
+			size_t size = 0;
+			for (uint32_t s = tasks.task_offsets[t]; s < tasks.task_offsets[t + 1]; s++) {
+				const IndexRange& segment = tasks.segments[s];
+				for (size_t b = segment.begin; b < segment.end; b++) {
+					uniform = uniform && width(b) == width(segment.begin);
+					covered.push_back(b);
+				}
+				size += segment.end - segment.begin;
+			}
+			full = full && (size == size_t(kBlocksPerTask) ||
+					(t + 1 == ntasks && size > 0 && size < size_t(kBlocksPerTask)));
+		}
+		check(covered == wanted && uniform && full &&
+				ntasks == (total + kBlocksPerTask - 1) / kBlocksPerTask, model,
+				std::to_string(total) + " blocks in " +
+				std::to_string(stream.block_runs.size()) + " runs split into " +
+				std::to_string(ntasks) + " full tasks of " +
+				std::to_string(tasks.segments.size()) + " single width segments");
+	}
+}
+
+/*
+ * Bone picking through the capsule BVH must return the same bone, at the
+ * same distance, as testing every bone, for random rays into the model
+ * in a few poses.
+ */
+void test_bone_picking(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	Skeleton* skeleton = mesh.skeleton;
+	glm::vec3 lo(mesh.bounds.min), hi(mesh.bounds.max);
+	glm::vec3 extent = hi - lo;
+	float radius = 0.01f * extent.y;
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	auto inside = [&]() {
+		return lo + extent * glm::vec3(uniform(rng), uniform(rng), uniform(rng));
+	};
+
+	int hits = 0, mismatches = 0;
+	for (int pose = 0; pose < 4; pose++) {
+		for (size_t b = 1; pose > 0 && b < skeleton->get_size(); b += 2)
+			skeleton->get_at(b)->rotate(0.3f,
+					glm::normalize(inside() - mesh.getCenter()));
+		for (int k = 0; k < 2000; k++) {
+			glm::vec3 eye = inside() + glm::vec3(0.0f, 0.0f, 2.0f * extent.z + 1.0f);
+			glm::vec3 dir = glm::normalize(inside() - eye);
+			Bone* expected = nullptr;
+			float closest = 0.0f;
+			for (size_t i = 0; i < skeleton->get_size(); i++) {
+				float x;
+				Bone* bone = skeleton->get_at(i);
+				if (bone->intersect(eye, dir, radius, x) &&
+				    (!expected || x < closest)) {
+					expected = bone;
+					closest = x;
+				}
+			}
+			float distance;
+			Bone* picked = skeleton->bone_inter(eye, dir, radius, distance);
+			if (expected)
+				hits++;
+			if (picked != expected || (expected && distance != closest))
+				mismatches++;
+		}
+	}
+	check(hits > 0 && mismatches == 0, model,
+			"BVH picking matches testing every bone (" +
+			std::to_string(mismatches) + " of " + std::to_string(hits) +
+			" hits differ)");
+}
+
+/*
+ * Axis aligned rays, whose zero direction components used to make the
+ * slab test NaN for origins on a box face. Rays in the faces of the boxes
+ * of a row of capsules, tested as their padded boxes, must find the same
+ * capsule as testing each one, with +0 and -0 as the zero components;
+ * and axis aligned picking on the skeleton must match testing every
+ * bone.
+ */
+void test_axis_aligned_picking(const std::string& model)
+{
+	const float r = 0.5f, padded = r * kBoxPadding;
+	std::vector<glm::vec3> a, b;
+	for (int i = 0; i < 8; i++) {
+		a.push_back(glm::vec3(2.0f * i, 0.0f, 0.0f));
+		b.push_back(glm::vec3(2.0f * i + 1.0f, 0.0f, 0.0f));
+	}
+	CapsuleBVH bvh;
+	bvh.build(a, b, r);
+	glm::vec3 lo(-padded), hi(15.0f + padded, padded, padded);
+	int hits = 0, mismatches = 0;
+	for (int face = 0; face < 3; face++)
+		for (float side : { lo[face], hi[face] })
+			for (int axis = 0; axis < 3; axis++)
+				for (float sign : { 1.0f, -1.0f })
+					for (float zero : { 0.0f, -0.0f })
+						for (float u = 0.0f; u <= 1.0f && axis != face; u += 0.125f) {
+							int other = 3 - face - axis;
+							glm::vec3 origin, dir(zero);
+							origin[face] = side;
+							origin[other] = lo[other] + u * (hi[other] - lo[other]);
+							origin[axis] = sign > 0.0f ? lo[axis] - 5.0f : hi[axis] + 5.0f;
+							dir[axis] = sign;
+							auto box_hit = [&](int i, float& x) {
+								glm::vec3 blo = glm::min(a[i], b[i]) - glm::vec3(padded);
+								glm::vec3 bhi = glm::max(a[i], b[i]) + glm::vec3(padded);
+								for (int k = 0; k < 3; k++)
+									if (k != axis && (origin[k] < blo[k] || origin[k] > bhi[k]))
+										return false;
+								x = std::max(sign > 0.0f ? blo[axis] - origin[axis] :
+										origin[axis] - bhi[axis], 0.0f);
+								return true;
+							};
+							int expected = -1;
+							float closest = 0.0f;
+							for (size_t i = 0; i < a.size(); i++) {
+								float x;
+								if (box_hit(i, x) && (expected < 0 || x < closest))
+									expected = i, closest = x;
+							}
+							float t;
+							int hit = bvh.raycast(origin, dir, t, box_hit);
+							hits += expected >= 0;
+							mismatches += hit != expected || (hit >= 0 && t != closest);
+						}
+	check(hits > 0 && mismatches == 0, model,
+			"rays in the faces of a BVH box hit like testing every capsule (" +
+			std::to_string(mismatches) + " of " + std::to_string(hits) +
+			" hits differ)");
+
+	Mesh mesh;
+	mesh.loadpmd(model);
+	Skeleton* skeleton = mesh.skeleton;
+	glm::vec3 mlo(mesh.bounds.min), extent = glm::vec3(mesh.bounds.max) - mlo;
+	float radius = 0.01f * extent.y;
+	std::mt19937 rng(21);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	hits = mismatches = 0;
+	for (int k = 0; k < 3000; k++) {
+		int axis = k % 3;
+		glm::vec3 eye = mlo + extent * glm::vec3(uniform(rng), uniform(rng), uniform(rng));
+		glm::vec3 dir(0.0f);
+		dir[axis] = k % 2 ? 1.0f : -1.0f;
+		eye[axis] = dir[axis] > 0.0f ? mlo[axis] - 1.0f : mlo[axis] + extent[axis] + 1.0f;
+		Bone* expected = nullptr;
+		float closest = 0.0f;
+		for (size_t i = 0; i < skeleton->get_size(); i++) {
+			float x;
+			Bone* bone = skeleton->get_at(i);
+			if (bone->intersect(eye, dir, radius, x) && (!expected || x < closest)) {
+				expected = bone;
+				closest = x;
+			}
+		}
+		float distance;
+		Bone* picked = skeleton->bone_inter(eye, dir, radius, distance);
+		hits += expected != nullptr;
+		mismatches += picked != expected || (expected && distance != closest);
+	}
+	check(hits > 0 && mismatches == 0, model,
+			"axis aligned BVH picking matches testing every bone (" +
+			std::to_string(mismatches) + " of " + std::to_string(hits) +
+			" hits differ)");
+}
+
+/*
+ * Random bone edits, some with the mesh skinned in between: copying only
+ * the range reported by update_joints() must keep an uploaded copy of the
+ * skeleton lines equal to a full move_joints().
+ */
+void test_update_joints(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	Skeleton* skeleton = mesh.skeleton;
+	std::vector<glm::vec4> points, uploaded, expected;
+	std::vector<glm::uvec2> lines;
+	skeleton->calc_joints(points, lines);
+	uploaded = points;
+
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+	bool ok = true;
+	for (int k = 0; k < 200 && ok; k++) {
+		int b = rng() % skeleton->get_size();
+		skeleton->get_at(b)->rotate(0.2f, glm::normalize(
+				glm::vec3(uniform(rng), uniform(rng), uniform(rng))));
+		if (k % 3 == 0)
+			mesh.updateAnimation();
+		IndexRange moved = skeleton->update_joints(points);
+		std::copy(points.begin() + moved.begin, points.begin() + moved.end,
+				uploaded.begin() + moved.begin);
+		skeleton->move_joints(expected);
+		ok = uploaded == expected;
+	}
+	check(ok, model, "update_joints ranges keep the skeleton lines current");
+}
+
+/*
+ * evaluate_poses() must give every pose the world matrices the skeleton
+ * computed for it, starting from empty outputs. With a lod, the bones it
+ * skips must still hold defined matrices.
+ */
+void test_evaluate_poses(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	Skeleton* skeleton = mesh.skeleton;
+	const int nposes = 4;
+	std::vector<SkeletonPose> poses(nposes);
+	std::vector<std::vector<glm::mat4>> expected(nposes);
+	std::vector<SkeletonPose*> batch;
+	for (int i = 0; i < nposes; i++) {
+		for (size_t b = 1 + i; b < skeleton->get_size(); b += 4)
+			skeleton->get_at(b)->rotate(0.4f, glm::vec3(1.0f, 0.0f, 0.0f));
+		skeleton->get_pose(poses[i]);
+		expected[i] = poses[i].world;
+		poses[i].world.clear();
+		batch.push_back(&poses[i]);
+	}
+	skeleton->evaluate_poses(batch);
+	bool ok = true;
+	for (int i = 0; i < nposes; i++)
+		ok = ok && poses[i].world == expected[i];
+	check(ok, model, "evaluate_poses matches update_world for each pose");
+
+	SkeletonLOD lod;
+	skeleton->build_lod(kLODMaxDepth, kLODMinImportance, kLODMaxBones, lod);
+	for (auto& pose : poses)
+		pose.world.clear();
+	skeleton->evaluate_poses(batch, &lod);
+	ok = true;
+	for (int i = 0; i < nposes; i++)
+		for (size_t b = 0; b < skeleton->get_size(); b++)
+			ok = ok && poses[i].world[b] ==
+				(lod.active[b] ? expected[i][b] : glm::mat4(1.0f));
+	check(ok, model, "evaluate_poses with a lod leaves skipped bones at identity");
+}
+
+/*
+ * IK towards tips that a second copy of the model reaches by rotating the
+ * same bone: most solves must converge. A zero time budget must stop the
+ * solve within its first sweep.
+ */
+void test_solve_ik(const std::string& model)
+{
+	Mesh posed, solved;
+	posed.loadpmd(model);
+	solved.loadpmd(model);
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+	int nsolves = 0, nconverged = 0;
+	for (int k = 0; k < 50; k++) {
+		int bone = 1 + rng() % (posed.getNumberOfBones() - 1);
+		Bone* moved = posed.skeleton->get_at(bone);
+		if (moved->get_length() < 1e-3f)
+			continue;
+		moved->rotate(0.4f * uniform(rng), glm::normalize(
+				glm::vec3(uniform(rng), uniform(rng), uniform(rng))));
+		glm::vec3 target(moved->transform() *
+				glm::vec4(0.0f, 0.0f, moved->get_length(), 1.0f));
+		IKStats stats = solved.skeleton->solve_ik(bone, target,
+				kIKChainLength, kIKMaxIterations, kIKTolerance, 1e3f);
+		nsolves++;
+		nconverged += stats.converged;
+	}
+	check(nconverged * 10 >= nsolves * 8, model, "solve_ik converges (" +
+			std::to_string(nconverged) + " of " + std::to_string(nsolves) + ")");
+
+	int bone = posed.getNumberOfBones() - 1;
+	glm::vec3 far_away(posed.bounds.max * 4.0f);
+	IKStats stats = solved.skeleton->solve_ik(bone, far_away,
+			kIKChainLength, kIKMaxIterations, 0.0f, 0.0f);
+	check(stats.iterations == 1, model, "solve_ik stops within a sweep out of time");
+}
+
+/*
+ * With only the bones the lod keeps posed, the frozen ones still follow
+ * them rigidly, so skinning through the lod must reproduce full skinning
+ * up to rounding. Instances are switched to the lod once they are small
+ * on screen, judged by the bind pose whatever the shared mesh's pose.
+ */
+void test_lod(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	const SkeletonLOD& lod = mesh.lod.skeleton;
+	std::mt19937 rng(5);
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+	for (size_t b = 1; b < mesh.skeleton->get_size(); b++)
+		if (lod.active[b])
+			mesh.skeleton->get_at(b)->rotate(0.3f * uniform(rng), glm::normalize(
+					glm::vec3(uniform(rng), uniform(rng), uniform(rng))));
+	mesh.updateAnimation();
+
+	std::vector<MeshInstance> instances(1);
+	mesh.skeleton->get_pose(instances[0].pose);
+	instances[0].lod = &mesh.lod;
+	mesh.updateInstancePalettes(instances);
+	mesh.updateInstances(instances);
+	float error = 0.0f;
+	for (size_t v = 0; v < mesh.vertices.size(); v++)
+		error = std::max(error, glm::length(mesh.animated_vertices[v] -
+				instances[0].animated_vertices[v]));
+	float extent = glm::length(glm::vec3(mesh.bounds.max - mesh.bounds.min));
+	check(lod.nactive < mesh.skeleton->get_size() && error <= 1e-5f * extent,
+			model, "lod with its frozen bones unposed matches full skinning (" +
+			std::to_string(lod.nactive) + " bones, error " +
+			std::to_string(error) + ")");
+
+	glm::mat4 projection = glm::perspective(float(kFov * (M_PI / 180.0f)),
+			4.0f / 3.0f, kNear, kFar);
+	glm::vec3 center = mesh.getCenter();
+	std::vector<MeshInstance> crowd(2);
+	crowd[1].model = glm::translate(glm::vec3(0.0f, 0.0f, -50.0f * extent));
+	glm::mat4 view = glm::lookAt(center + glm::vec3(0.0f, 0.0f, extent),
+			center, glm::vec3(0.0f, 1.0f, 0.0f));
+	mesh.selectLOD(crowd, view, projection);
+	check(crowd[0].lod == nullptr && crowd[1].lod == &mesh.lod, model,
+			"selectLOD gives only the distant instance the lod");
+
+	Mesh unposed;
+	unposed.loadpmd(model);
+	bool same = true;
+	for (const auto& instance : crowd)
+		same = same && mesh.projectedSize(view * instance.model, projection) ==
+				unposed.projectedSize(view * instance.model, projection);
+	check(same, model, "projectedSize does not depend on the shared pose");
+}
+
+/*
+ * A random affine palette of njoints entries in the row layout of the
+ * kernels (12 floats per entry), with the identity appended.
+ */
+std::vector<float> random_palette_rows(size_t njoints, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+	std::vector<float> rows((njoints + 1) * 12, 0.0f);
+	for (size_t j = 0; j < njoints; j++)
+		for (int r = 0; r < 3; r++)
+			for (int c = 0; c < 4; c++)
+				rows[j * 12 + r * 4 + c] = (r == c ? 1.0f : 0.0f) + 0.5f * uniform(rng);
+	for (int r = 0; r < 3; r++)
+		rows[njoints * 12 + r * 5] = 1.0f;
+	return rows;
+}
+
+/*
+ * Runs every supported kernel over the stream, block by block through
+ * run[skinning_kernel_slot(width)] and in one call through the any-width
+ * entry, and compares with linear blend skinning of the table done here.
+ * The outputs are one block longer than the vertices and start out as
+ * garbage, so writes into the padded tail show up too.
+ */
+void check_kernels(const SkinningStream& stream, const InfluenceTable& influences,
+		const std::vector<glm::vec4>& vertices,
+		const std::vector<glm::vec4>& normals,
+		const std::vector<float>& rows,
+		const std::string& model, const std::string& what)
+{
+	size_t nvertices = vertices.size();
+	size_t identity = influences.njoints * 12;
+	std::vector<glm::vec3> ref_positions(nvertices), ref_normals(nvertices);
+	for (size_t v = 0; v < nvertices; v++) {
+		float m[12] = {};
+		for (uint32_t i = influences.offsets[v]; i < influences.offsets[v + 1]; i++)
+			for (int e = 0; e < 12; e++)
+				m[e] += influences.weights[i] * rows[influences.joints[i] * 12 + e];
+		if (influences.offsets[v] == influences.offsets[v + 1])
+			std::copy(&rows[identity], &rows[identity] + 12, m);
+		const glm::vec4& p = vertices[v];
+		const glm::vec4& n = normals[v];
+		for (int r = 0; r < 3; r++) {
+			ref_positions[v][r] = m[r * 4] * p.x + m[r * 4 + 1] * p.y + m[r * 4 + 2] * p.z + m[r * 4 + 3];
+			ref_normals[v][r] = m[r * 4] * n.x + m[r * 4 + 1] * n.y + m[r * 4 + 2] * n.z;
+		}
+	}
+
+	size_t nblocks = stream.getNumberOfBlocks();
+	size_t noutputs = nvertices + kSkinLanes;
+	for (const SkinningKernelInfo& kernel : supported_skinning_kernels()) {
+		for (int pass = 0; pass < 2; pass++) {
+			std::vector<glm::vec3> positions(noutputs, glm::vec3(1e30f));
+			std::vector<uint32_t> packed(noutputs, ~0u);
+			if (pass == 0) {
+				for (size_t b = 0; b < nblocks; b++) {
+					uint32_t width = stream.block_slots[b + 1] - stream.block_slots[b];
+					kernel.run[skinning_kernel_slot(width)](stream, rows.data(),
+							b, b + 1, positions.data(), packed.data());
+				}
+			} else {
+				kernel.run[3](stream, rows.data(), 0, nblocks,
+						positions.data(), packed.data());
+			}
+
+			float position_error = 0.0f, normal_error = 0.0f;
+			for (size_t v = 0; v < nvertices; v++) {
+				const glm::vec3& p = ref_positions[v];
+				position_error = std::max(position_error,
+						glm::length(positions[v] - p) / (1.0f + glm::length(p)));
+				float length = glm::length(ref_normals[v]);
+				if (length < 1e-3f)
+					continue;
+				glm::vec3 d = glm::abs(unpack_normal(packed[v]) - ref_normals[v] / length);
+				normal_error = std::max(normal_error, std::max(d.x, std::max(d.y, d.z)));
+			}
+			bool tail = true;
+			for (size_t v = nvertices; v < noutputs; v++)
+				tail = tail && positions[v].x == 1e30f && packed[v] == ~0u;
+			// Rounding to 10 bits is off by at most half a step.
+			check(position_error <= 1e-5f && normal_error <= 0.6f / 511.0f && tail, model,
+					std::string(kernel.name) + (pass == 0 ? " per width" : " any width") +
+					" kernel matches reference skinning of " + what +
+					" (position error " + std::to_string(position_error) +
+					", normal error " + std::to_string(normal_error) + ")");
+		}
+	}
+}
+
+/*
+ * Cross-checks the kernels on the stream of the model, and on a made up
+ * one that has blocks of every width, unweighted vertices (which take
+ * the identity entry) and a partial last block.
+ */
+void test_kernels(const std::string& model)
+{
+	Mesh mesh;
+	mesh.loadpmd(model);
+	std::mt19937 rng(6);
+	check_kernels(mesh.skinning_stream, mesh.influences, mesh.vertices,
+			mesh.vertex_normals,
+			random_palette_rows(mesh.influences.njoints, rng),
+			model, "the model");
+
+	const size_t njoints = 10;
+	const int kMaxWidth = 5;
+	const size_t nvertices = (kMaxWidth + 1) * 4 * kSkinLanes + 3;
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+	std::vector<glm::vec4> vertices(nvertices), normals(nvertices);
+	std::vector<SparseTuple> tuples;
+	for (size_t v = 0; v < nvertices; v++) {
+		vertices[v] = glm::vec4(10.0f * uniform(rng), 10.0f * uniform(rng),
+				10.0f * uniform(rng), 1.0f);
+		normals[v] = glm::vec4(glm::normalize(glm::vec3(uniform(rng),
+				uniform(rng), uniform(rng))), 0.0f);
+		// Block b has rows of up to b % (kMaxWidth + 1) influences, the
+		// first vertex of the block the full count.
+		int width = (v / kSkinLanes) % (kMaxWidth + 1);
+		int count = v % kSkinLanes == 0 ? width : std::uniform_int_distribution<int>(0, width)(rng);
+		for (int k = 0; k < count; k++)
+			tuples.emplace_back((v + k) % njoints, v, 0.5f + 0.5f * uniform(rng));
+	}
+	InfluenceTable influences;
+	influences.build(tuples, nvertices, njoints);
+	SkinningStream stream;
+	stream.build(influences, vertices, normals);
+	check_kernels(stream, influences, vertices, normals,
+			random_palette_rows(njoints, rng), model, "blocks of every width");
+}
+
+/*
+ * SKINNING_KERNEL caps the selection to the widest supported kernel at
+ * or below the named one, and unknown names are ignored.
+ */
+void test_kernel_selection(const std::string& model)
+{
+	std::vector<SkinningKernelInfo> kernels = supported_skinning_kernels();
+	const char* saved = getenv("SKINNING_KERNEL");
+	std::string restore = saved ? saved : "";
+	auto select = [](const char* cap) {
+		setenv("SKINNING_KERNEL", cap, 1);
+		return std::string(select_skinning_kernel().name);
+	};
+	std::string below_avx2 = kernels.back().name;
+	for (const SkinningKernelInfo& kernel : kernels)
+		if (std::string(kernel.name) != "avx2") {
+			below_avx2 = kernel.name;
+			break;
+		}
+	check(select("") == kernels.front().name &&
+			select("avx2") == kernels.front().name &&
+			select("sse4.1") == below_avx2 &&
+			select("scalar") == "scalar" &&
+			select("avx512") == kernels.front().name, model,
+			"SKINNING_KERNEL caps the kernel selection");
+	if (saved)
+		setenv("SKINNING_KERNEL", restore.c_str(), 1);
+	else
+		unsetenv("SKINNING_KERNEL");
+}
+
+/*
+ * pack_normal() rounds each component to the nearest of the 10 bit snorm
+ * steps of 1/511, so unpacking gives it back within half a step, with
+ * w left at 0. Axis aligned and negative components are tried along
+ * with random unit vectors, and every code but -512 (which reads as -1
+ * like -511) must survive unpacking and packing again.
+ */
+void test_pack_normal(const std::string& model)
+{
+	std::vector<glm::vec3> normals;
+	for (int axis = 0; axis < 3; axis++)
+		for (float sign : { 1.0f, -1.0f }) {
+			glm::vec3 n(0.0f);
+			n[axis] = sign;
+			normals.push_back(n);
+		}
+	normals.push_back(glm::normalize(glm::vec3(-1.0f, -1.0f, -1.0f)));
+	normals.push_back(glm::normalize(glm::vec3(1.0f, -2.0f, 0.0f)));
+	std::mt19937 rng(12);
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+	for (int i = 0; i < 1000; i++)
+		normals.push_back(glm::normalize(glm::vec3(uniform(rng), uniform(rng), uniform(rng))));
+
+	float error = 0.0f;
+	bool w = true;
+	for (const auto& n : normals) {
+		uint32_t packed = pack_normal(n);
+		glm::vec3 d = glm::abs(unpack_normal(packed) - n);
+		error = std::max(error, std::max(d.x, std::max(d.y, d.z)));
+		w = w && (packed >> 30) == 0;
+	}
+	bool codes = true;
+	for (uint32_t code = 0; code < 1024; code++) {
+		uint32_t packed = code | (code << 10) | (code << 20);
+		uint32_t expected = code == 0x200 ? 0x201 * 0x100401 : packed;
+		codes = codes && pack_normal(unpack_normal(packed)) == expected;
+	}
+	check(error <= 0.5f / 511.0f + 1e-6f && w && codes, model,
+			"pack_normal round trips within half a 10 bit step (error " +
+			std::to_string(error) + ")");
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <PMD file>..." << std::endl;
+		return -1;
+	}
+	for (int i = 1; i < argc; i++) {
+		std::string model = argv[i];
+		test_skin_into(model);
+		test_instances(model);
+		test_pose_tolerance(model);
+		test_incremental_normals(model);
+		test_bounds(model);
+		test_mesh_optimizer(model);
+		test_prune(model);
+		test_tasks(model);
+		test_bone_picking(model);
+		test_axis_aligned_picking(model);
+		test_update_joints(model);
+		test_evaluate_poses(model);
+		test_solve_ik(model);
+		test_lod(model);
+		test_kernels(model);
+		test_kernel_selection(model);
+		test_pack_normal(model);
+	}
+	return failures;
+}